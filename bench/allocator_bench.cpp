@@ -0,0 +1,349 @@
+// Headless allocator microbenchmarks, see bench/CMakeLists.txt. Only depends on the cross platform
+// allocator code, so it builds on Linux without D3D.
+//
+// Prints one CSV row per allocator/workload/thread count to stdout, so results from two versions can
+// be diffed or loaded into a spreadsheet:
+//   allocator,workload,threads,operations,best_ns_per_op,median_ns_per_op
+// An operation is one allocation plus one free.
+
+#include "BlockAllocator.h"
+#include "memutils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <latch>
+#include <memory>
+#include <memory_resource>
+#include <numeric>
+#include <random>
+#include <span>
+#include <thread>
+#include <vector>
+
+using namespace ggp;
+
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+
+	// about the size of a transform, the allocator's biggest user
+	constexpr size_t blockSize = 64;
+	constexpr size_t blockAlignment = 16;
+
+	struct Config
+	{
+		// number of objects kept alive during churn, and allocated per round in the bulk workloads
+		size_t liveObjects = 10000;
+		// per thread
+		size_t operations = 2000000;
+		size_t repeats = 5;
+		u32 threads = 4;
+	};
+
+	inline f64 SecondsSince(Clock::time_point start) noexcept
+	{
+		return std::chrono::duration<f64>(Clock::now() - start).count();
+	}
+
+	// write to the new memory so that allocators which hand out untouched pages pay for the fault
+	inline void* Touch(void* p) noexcept
+	{
+		static_cast<volatile u8*>(p)[0] = 1;
+		return p;
+	}
+
+	// every allocator under test is split into the shared state, created once per run, and a handle
+	// which each thread constructs from it
+
+	struct NoSharedState {};
+
+	struct MallocHandle
+	{
+		explicit MallocHandle(NoSharedState&) noexcept {}
+		inline void* Alloc() noexcept { return std::malloc(blockSize); }
+		inline void Free(void* p) noexcept { std::free(p); }
+	};
+
+	struct NewHandle
+	{
+		explicit NewHandle(NoSharedState&) noexcept {}
+		inline void* Alloc() noexcept { return ::operator new(blockSize); }
+		inline void Free(void* p) noexcept { ::operator delete(p, blockSize); }
+	};
+
+	template <typename Resource>
+	struct PmrHandle
+	{
+		explicit PmrHandle(Resource& resource) noexcept : resource(&resource) {}
+		inline void* Alloc() noexcept { return resource->allocate(blockSize, blockAlignment); }
+		inline void Free(void* p) noexcept { resource->deallocate(p, blockSize, blockAlignment); }
+		Resource* resource;
+	};
+
+	struct BlockHandle
+	{
+		explicit BlockHandle(BlockAllocator& allocator) noexcept : allocator(&allocator) {}
+		inline void* Alloc() noexcept { return allocator->Alloc().data(); }
+		inline void Free(void* p) noexcept { allocator->Free({ (u8*)p, blockSize }); }
+		inline bool AllocN(std::span<u8*> out) noexcept { return allocator->AllocN(out); }
+		inline void FreeN(std::span<u8* const> blocks) noexcept { allocator->FreeN(blocks); }
+		BlockAllocator* allocator;
+	};
+
+	struct ThreadCacheHandle
+	{
+		explicit ThreadCacheHandle(BlockAllocator& allocator) noexcept : cache(allocator) {}
+		inline void* Alloc() noexcept { return cache.Alloc().data(); }
+		inline void Free(void* p) noexcept { cache.Free({ (u8*)p, blockSize }); }
+		BlockAllocator::ThreadCache cache;
+	};
+
+	auto MakeBlockAllocator(BlockAllocator::Concurrency concurrency, BlockAllocator::AllocationPolicy policy)
+	{
+		return [=] {
+			return std::make_unique<BlockAllocator>(BlockAllocator::Options{
+				.maxBytes = 4_GB,
+				.initialBytes = 1_MB,
+				.blockSize = blockSize,
+				.minimumAlignmentExponent = alignment_exponent(blockAlignment),
+				.concurrency = concurrency,
+				.allocationPolicy = policy,
+				.debugName = "benchmark",
+			});
+		};
+	}
+
+	// workloads return the seconds spent in the measured part. setup (filling the live set, picking
+	// random indices) is not counted. if start is given, every thread waits on it before measuring
+
+	// steady state: a fixed number of live objects, each operation frees a random one and replaces it
+	template <typename Handle>
+	f64 Churn(Handle& handle, const Config& config, u32 seed, std::latch* start)
+	{
+		std::vector<void*> live(config.liveObjects);
+		for (void*& p : live)
+			p = Touch(handle.Alloc());
+
+		std::mt19937 rng(seed);
+		std::uniform_int_distribution<u32> pick(0, u32(config.liveObjects - 1));
+		std::vector<u32> victims(config.operations);
+		for (u32& v : victims)
+			v = pick(rng);
+
+		if (start)
+			start->arrive_and_wait();
+		const Clock::time_point begin = Clock::now();
+		for (u32 v : victims)
+		{
+			handle.Free(live[v]);
+			live[v] = Touch(handle.Alloc());
+		}
+		const f64 seconds = SecondsSince(begin);
+
+		for (void* p : live)
+			handle.Free(p);
+		return seconds;
+	}
+
+	// allocate a whole level's worth of objects, then free them all in allocation order
+	template <typename Handle>
+	f64 BulkCreateDestroy(Handle& handle, const Config& config, u32, std::latch* start)
+	{
+		std::vector<void*> objects(config.liveObjects);
+		const size_t rounds = config.operations / config.liveObjects;
+
+		if (start)
+			start->arrive_and_wait();
+		const Clock::time_point begin = Clock::now();
+		for (size_t r = 0; r < rounds; ++r)
+		{
+			for (void*& p : objects)
+				p = Touch(handle.Alloc());
+			for (void* p : objects)
+				handle.Free(p);
+		}
+		return SecondsSince(begin);
+	}
+
+	// same as BulkCreateDestroy, but through AllocN/FreeN
+	template <typename Handle>
+	f64 BulkCreateDestroyBatched(Handle& handle, const Config& config, u32, std::latch* start)
+	{
+		std::vector<u8*> objects(config.liveObjects);
+		const size_t rounds = config.operations / config.liveObjects;
+
+		if (start)
+			start->arrive_and_wait();
+		const Clock::time_point begin = Clock::now();
+		for (size_t r = 0; r < rounds; ++r)
+		{
+			if (!handle.AllocN(objects))
+			{
+				std::fprintf(stderr, "ERROR: benchmark allocator ran out of memory\n");
+				std::abort();
+			}
+			for (u8* p : objects)
+				Touch(p);
+			handle.FreeN(objects);
+		}
+		return SecondsSince(begin);
+	}
+
+	// allocate a batch, then free it in a random order, which scatters free lists
+	template <typename Handle>
+	f64 RandomOrderFree(Handle& handle, const Config& config, u32 seed, std::latch* start)
+	{
+		std::vector<void*> objects(config.liveObjects);
+		std::vector<u32> order(config.liveObjects);
+		std::iota(order.begin(), order.end(), 0);
+		std::shuffle(order.begin(), order.end(), std::mt19937(seed));
+		const size_t rounds = config.operations / config.liveObjects;
+
+		if (start)
+			start->arrive_and_wait();
+		const Clock::time_point begin = Clock::now();
+		for (size_t r = 0; r < rounds; ++r)
+		{
+			for (void*& p : objects)
+				p = Touch(handle.Alloc());
+			for (u32 i : order)
+				handle.Free(objects[i]);
+		}
+		return SecondsSince(begin);
+	}
+
+	template <typename Handle>
+	concept Batched = requires(Handle h, std::span<u8*> out, std::span<u8* const> in) {
+		h.AllocN(out);
+		h.FreeN(in);
+	};
+
+	template <typename Handle>
+	using Workload = f64(*)(Handle&, const Config&, u32, std::latch*);
+
+	// run one workload config.repeats times on fresh allocators, and print the result
+	template <typename Handle, typename MakeShared>
+	void Measure(const char* allocatorName, const char* workloadName, Workload<Handle> workload,
+		MakeShared makeShared, const Config& config, u32 threads)
+	{
+		std::vector<f64> nsPerOp;
+		size_t operationsPerThread = config.operations;
+		// the bulk workloads only run whole rounds
+		if (workload != &Churn<Handle>)
+			operationsPerThread -= operationsPerThread % config.liveObjects;
+
+		for (size_t repeat = 0; repeat < config.repeats; ++repeat)
+		{
+			auto shared = makeShared();
+			f64 seconds = 0;
+			if (threads == 1)
+			{
+				Handle handle(*shared);
+				seconds = workload(handle, config, u32(repeat), nullptr);
+			}
+			else
+			{
+				// wall time is the slowest thread, since they all start together
+				std::latch start(threads);
+				std::vector<f64> threadSeconds(threads);
+				std::vector<std::thread> workers;
+				for (u32 t = 0; t < threads; ++t)
+				{
+					workers.emplace_back([&, t] {
+						Handle handle(*shared);
+						threadSeconds[t] = workload(handle, config, u32(repeat * threads + t), &start);
+					});
+				}
+				for (std::thread& worker : workers)
+					worker.join();
+				seconds = *std::max_element(threadSeconds.begin(), threadSeconds.end());
+			}
+			nsPerOp.push_back(seconds * 1e9 / f64(operationsPerThread * threads));
+		}
+
+		std::sort(nsPerOp.begin(), nsPerOp.end());
+		std::printf("%s,%s,%u,%zu,%.3f,%.3f\n", allocatorName, workloadName, threads, operationsPerThread * threads,
+			nsPerOp.front(), nsPerOp[nsPerOp.size() / 2]);
+		std::fflush(stdout);
+	}
+
+	template <typename Handle, typename MakeShared>
+	void Benchmark(const char* name, bool threadSafe, MakeShared makeShared, const Config& config)
+	{
+		Measure<Handle>(name, "churn", &Churn<Handle>, makeShared, config, 1);
+		Measure<Handle>(name, "bulk", &BulkCreateDestroy<Handle>, makeShared, config, 1);
+		if constexpr (Batched<Handle>)
+			Measure<Handle>(name, "bulk_batched", &BulkCreateDestroyBatched<Handle>, makeShared, config, 1);
+		Measure<Handle>(name, "random_free", &RandomOrderFree<Handle>, makeShared, config, 1);
+
+		if (!threadSafe || config.threads < 2)
+			return;
+		Measure<Handle>(name, "churn", &Churn<Handle>, makeShared, config, config.threads);
+		Measure<Handle>(name, "bulk", &BulkCreateDestroy<Handle>, makeShared, config, config.threads);
+		Measure<Handle>(name, "random_free", &RandomOrderFree<Handle>, makeShared, config, config.threads);
+	}
+
+	void PrintUsage()
+	{
+		std::fprintf(stderr,
+			"usage: allocator_bench [--quick] [--threads N] [--repeats N]\n"
+			"  --quick      a tenth of the operations, for smoke testing\n"
+			"  --threads N  thread count for the multithreaded workloads (default 4, 1 to skip them)\n"
+			"  --repeats N  runs per measurement, the best and median are reported (default 5)\n");
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Config config;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::strcmp(argv[i], "--quick") == 0)
+		{
+			config.operations /= 10;
+		}
+		else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			config.threads = u32((std::max)(1, std::atoi(argv[++i])));
+		}
+		else if (std::strcmp(argv[i], "--repeats") == 0 && i + 1 < argc)
+		{
+			config.repeats = size_t((std::max)(1, std::atoi(argv[++i])));
+		}
+		else
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	using Concurrency = BlockAllocator::Concurrency;
+	using AllocationPolicy = BlockAllocator::AllocationPolicy;
+	const auto noSharedState = [] { return std::make_unique<NoSharedState>(); };
+
+	std::printf("allocator,workload,threads,operations,best_ns_per_op,median_ns_per_op\n");
+
+	Benchmark<MallocHandle>("malloc", true, noSharedState, config);
+	Benchmark<NewHandle>("new", true, noSharedState, config);
+	Benchmark<PmrHandle<std::pmr::unsynchronized_pool_resource>>("pmr_unsynchronized_pool", false,
+		[] { return std::make_unique<std::pmr::unsynchronized_pool_resource>(); }, config);
+	Benchmark<PmrHandle<std::pmr::synchronized_pool_resource>>("pmr_synchronized_pool", true,
+		[] { return std::make_unique<std::pmr::synchronized_pool_resource>(); }, config);
+
+	Benchmark<BlockHandle>("block_single_freelist", false,
+		MakeBlockAllocator(Concurrency::SingleThreaded, AllocationPolicy::FreeList), config);
+	Benchmark<BlockHandle>("block_single_lowest_address", false,
+		MakeBlockAllocator(Concurrency::SingleThreaded, AllocationPolicy::LowestAddress), config);
+	Benchmark<BlockHandle>("block_locked", true,
+		MakeBlockAllocator(Concurrency::Locked, AllocationPolicy::FreeList), config);
+	Benchmark<BlockHandle>("block_lockfree", true,
+		MakeBlockAllocator(Concurrency::LockFree, AllocationPolicy::FreeList), config);
+	Benchmark<ThreadCacheHandle>("block_locked_threadcache", true,
+		MakeBlockAllocator(Concurrency::Locked, AllocationPolicy::FreeList), config);
+	Benchmark<ThreadCacheHandle>("block_lockfree_threadcache", true,
+		MakeBlockAllocator(Concurrency::LockFree, AllocationPolicy::FreeList), config);
+	return 0;
+}
\ No newline at end of file
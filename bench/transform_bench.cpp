@@ -0,0 +1,219 @@
+// Headless benchmark of the world matrix kernels UpdateAll() uses, see bench/CMakeLists.txt. Each
+// supported SimdLevel recomputes the same randomly shaped hierarchy, one depth at a time like UpdateAll.
+//
+// Prints one CSV row per kernel/layout to stdout:
+//   kernel,layout,transforms,levels,best_ns_per_transform,median_ns_per_transform
+// The sequential layout has handles in depth order, shuffled scatters them like a long running scene.
+
+#include "TransformUpdate.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <vector>
+
+using namespace ggp;
+
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+
+	struct Config
+	{
+		size_t transforms = 100000;
+		// children per transform are picked from [0, maxChildren]
+		u32 maxChildren = 6;
+		size_t iterations = 100;
+		size_t repeats = 5;
+	};
+
+	// the hierarchy flattened the way UpdateAll hands it to the kernels
+	struct Scene
+	{
+		std::vector<LocalTransform> locals;
+		std::vector<DirectX::XMFLOAT4X4A> worldMatrices;
+		// grouped by depth
+		std::vector<u32> transforms;
+		std::vector<i32> parents;
+		std::vector<size_t> levelEnds;
+	};
+
+	Scene MakeScene(const Config& config, bool shuffled)
+	{
+		std::mt19937 rng(1);
+		std::uniform_int_distribution<u32> childCount(0, config.maxChildren);
+		std::uniform_real_distribution<f32> angle(-DirectX::XM_PI, DirectX::XM_PI);
+		std::uniform_real_distribution<f32> offset(-10.0f, 10.0f);
+		std::uniform_real_distribution<f32> scale(0.5f, 2.0f);
+
+		// handle of each transform, in breadth first order
+		std::vector<u32> handles(config.transforms);
+		std::iota(handles.begin(), handles.end(), 0);
+		if (shuffled)
+			std::shuffle(handles.begin(), handles.end(), rng);
+
+		Scene scene;
+		scene.locals.resize(config.transforms);
+		scene.worldMatrices.resize(config.transforms);
+		for (LocalTransform& local : scene.locals)
+		{
+			local.position = { offset(rng), offset(rng), offset(rng) };
+			DirectX::XMStoreFloat4(&local.rotation, DirectX::XMQuaternionRotationRollPitchYaw(angle(rng), angle(rng), angle(rng)));
+			local.scale = { scale(rng), scale(rng), scale(rng) };
+		}
+
+		// grow the tree a level at a time until there are enough transforms. a level with no children
+		// starts a new root so the count is always reached
+		size_t created = 0;
+		size_t levelBegin = 0;
+		while (created < config.transforms)
+		{
+			const size_t levelEnd = scene.transforms.size();
+			if (levelBegin == levelEnd)
+			{
+				scene.transforms.push_back(handles[created++]);
+				scene.parents.push_back(-1);
+				scene.levelEnds.push_back(scene.transforms.size());
+				continue;
+			}
+			for (size_t i = levelBegin; i < levelEnd && created < config.transforms; ++i)
+			{
+				for (u32 c = childCount(rng); c > 0 && created < config.transforms; --c)
+				{
+					scene.transforms.push_back(handles[created++]);
+					scene.parents.push_back(i32(scene.transforms[i]));
+				}
+			}
+			levelBegin = levelEnd;
+			scene.levelEnds.push_back(scene.transforms.size());
+		}
+		return scene;
+	}
+
+	void Measure(const char* kernelName, ComposeWorldMatricesFunction compose, const char* layoutName,
+		Scene& scene, const Config& config)
+	{
+		std::vector<f64> nsPerTransform;
+		for (size_t repeat = 0; repeat < config.repeats; ++repeat)
+		{
+			const Clock::time_point begin = Clock::now();
+			for (size_t iteration = 0; iteration < config.iterations; ++iteration)
+			{
+				size_t levelBegin = 0;
+				for (const size_t levelEnd : scene.levelEnds)
+				{
+					compose(ComposeBatch{
+						.transforms = scene.transforms.data() + levelBegin,
+						.parents = scene.parents.data() + levelBegin,
+						.count = levelEnd - levelBegin,
+						.locals = scene.locals.data(),
+						.worldMatrices = scene.worldMatrices.data(),
+					});
+					levelBegin = levelEnd;
+				}
+			}
+			const f64 seconds = std::chrono::duration<f64>(Clock::now() - begin).count();
+			nsPerTransform.push_back(seconds * 1e9 / f64(config.iterations * config.transforms));
+		}
+
+		std::sort(nsPerTransform.begin(), nsPerTransform.end());
+		std::printf("%s,%s,%zu,%zu,%.3f,%.3f\n", kernelName, layoutName, config.transforms, scene.levelEnds.size(),
+			nsPerTransform.front(), nsPerTransform[nsPerTransform.size() / 2]);
+		std::fflush(stdout);
+	}
+
+	// the largest difference from the scalar results, relative to the size of the matrix it is in
+	f32 MaxError(const std::vector<DirectX::XMFLOAT4X4A>& expected, const std::vector<DirectX::XMFLOAT4X4A>& actual)
+	{
+		f32 error = 0;
+		for (size_t i = 0; i < expected.size(); ++i)
+		{
+			f32 difference = 0;
+			f32 magnitude = 1;
+			for (size_t j = 0; j < 16; ++j)
+			{
+				const f32 e = (&expected[i].m[0][0])[j];
+				const f32 a = (&actual[i].m[0][0])[j];
+				difference = (std::max)(difference, std::abs(e - a));
+				magnitude = (std::max)(magnitude, std::abs(e));
+			}
+			error = (std::max)(error, difference / magnitude);
+		}
+		return error;
+	}
+
+	void PrintUsage()
+	{
+		std::fprintf(stderr,
+			"usage: transform_bench [--quick] [--transforms N] [--repeats N]\n"
+			"  --quick         a tenth of the iterations, for smoke testing\n"
+			"  --transforms N  size of the hierarchy (default 100000)\n"
+			"  --repeats N     runs per measurement, the best and median are reported (default 5)\n");
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Config config;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::strcmp(argv[i], "--quick") == 0)
+		{
+			config.iterations /= 10;
+		}
+		else if (std::strcmp(argv[i], "--transforms") == 0 && i + 1 < argc)
+		{
+			config.transforms = size_t((std::max)(1, std::atoi(argv[++i])));
+		}
+		else if (std::strcmp(argv[i], "--repeats") == 0 && i + 1 < argc)
+		{
+			config.repeats = size_t((std::max)(1, std::atoi(argv[++i])));
+		}
+		else
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	struct Kernel
+	{
+		const char* name;
+		SimdLevel level;
+	};
+	const Kernel kernels[] = {
+		{ "scalar", SimdLevel::Scalar },
+		{ "sse2", SimdLevel::SSE2 },
+		{ "avx2", SimdLevel::AVX2 },
+	};
+	const SimdLevel supported = DetectSimdLevel();
+
+	std::printf("kernel,layout,transforms,levels,best_ns_per_transform,median_ns_per_transform\n");
+	for (const bool shuffled : { false, true })
+	{
+		Scene scene = MakeScene(config, shuffled);
+		const char* const layoutName = shuffled ? "shuffled" : "sequential";
+		std::vector<DirectX::XMFLOAT4X4A> scalarWorlds;
+		for (const Kernel& kernel : kernels)
+		{
+			if (kernel.level > supported)
+			{
+				std::fprintf(stderr, "skipping %s, not supported by this CPU\n", kernel.name);
+				continue;
+			}
+			Measure(kernel.name, GetComposeWorldMatrices(kernel.level), layoutName, scene, config);
+
+			// a fast kernel is no use if it is wrong
+			if (kernel.level == SimdLevel::Scalar)
+				scalarWorlds = scene.worldMatrices;
+			else if (const f32 error = MaxError(scalarWorlds, scene.worldMatrices); error > 1e-4f)
+				std::fprintf(stderr, "WARNING: %s differs from scalar by up to %g\n", kernel.name, error);
+		}
+	}
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,111 @@
+#include "AllocatorStats.h"
+
+#if GGP_ALLOCATOR_STATS
+#include "BlockAllocator.h"
+#include <algorithm>
+#include <utility>
+
+namespace
+{
+	// raise peak to value, if value is higher
+	inline void UpdatePeak(std::atomic<u64>& peak, u64 value) noexcept
+	{
+		u64 current = peak.load(std::memory_order_relaxed);
+		while (value > current && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+	}
+
+	struct Registry
+	{
+		std::mutex lock;
+		std::vector<ggp::BlockAllocator*> allocators;
+	};
+
+	Registry& GetRegistry() noexcept
+	{
+		static Registry registry;
+		return registry;
+	}
+}
+
+void ggp::AllocatorStats::TakeFrom(AllocatorStats& other) noexcept
+{
+	m_liveBlocks.store(other.m_liveBlocks.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+	m_peakLiveBlocks.store(other.m_peakLiveBlocks.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+	m_committedBytes.store(other.m_committedBytes.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+	m_peakCommittedBytes.store(other.m_peakCommittedBytes.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+	m_reservedBytes.store(other.m_reservedBytes.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+	m_failedAllocations.store(other.m_failedAllocations.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+	m_invalidFrees.store(other.m_invalidFrees.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+
+	std::scoped_lock lock(m_growEventsLock, other.m_growEventsLock);
+	m_growEvents = other.m_growEvents;
+	m_growCount = std::exchange(other.m_growCount, 0);
+}
+
+void ggp::AllocatorStats::OnAlloc(u64 count) noexcept
+{
+	const u64 live = m_liveBlocks.fetch_add(count, std::memory_order_relaxed) + count;
+	UpdatePeak(m_peakLiveBlocks, live);
+}
+
+void ggp::AllocatorStats::SetCommitted(size_t bytes) noexcept
+{
+	m_committedBytes.store(bytes, std::memory_order_relaxed);
+	UpdatePeak(m_peakCommittedBytes, bytes);
+}
+
+void ggp::AllocatorStats::OnGrow(size_t oldCommittedBytes, size_t newCommittedBytes) noexcept
+{
+	SetCommitted(newCommittedBytes);
+	std::lock_guard lock(m_growEventsLock);
+	m_growEvents[m_growCount % maxGrowEvents] = GrowEvent{
+		.time = std::chrono::steady_clock::now(),
+		.oldCommittedBytes = oldCommittedBytes,
+		.newCommittedBytes = newCommittedBytes,
+	};
+	++m_growCount;
+}
+
+void ggp::AllocatorStats::FillSnapshot(Snapshot& out) const noexcept
+{
+	out.liveBlocks = m_liveBlocks.load(std::memory_order_relaxed);
+	out.peakLiveBlocks = m_peakLiveBlocks.load(std::memory_order_relaxed);
+	out.committedBytes = m_committedBytes.load(std::memory_order_relaxed);
+	out.peakCommittedBytes = m_peakCommittedBytes.load(std::memory_order_relaxed);
+	out.reservedBytes = m_reservedBytes.load(std::memory_order_relaxed);
+	out.failedAllocations = m_failedAllocations.load(std::memory_order_relaxed);
+	out.invalidFrees = m_invalidFrees.load(std::memory_order_relaxed);
+
+	std::lock_guard lock(m_growEventsLock);
+	out.growCount = m_growCount;
+	out.recentGrowEventCount = m_growCount < maxGrowEvents ? size_t(m_growCount) : maxGrowEvents;
+	// unroll the ring buffer so the oldest event comes first
+	const u64 first = m_growCount - out.recentGrowEventCount;
+	for (size_t i = 0; i < out.recentGrowEventCount; ++i)
+		out.recentGrowEvents[i] = m_growEvents[(first + i) % maxGrowEvents];
+}
+
+void ggp::AllocatorRegistry::Register(BlockAllocator* allocator) noexcept
+{
+	Registry& registry = GetRegistry();
+	std::lock_guard lock(registry.lock);
+	registry.allocators.push_back(allocator);
+}
+
+void ggp::AllocatorRegistry::Unregister(BlockAllocator* allocator) noexcept
+{
+	Registry& registry = GetRegistry();
+	std::lock_guard lock(registry.lock);
+	std::erase(registry.allocators, allocator);
+}
+
+auto ggp::AllocatorRegistry::SnapshotAll() noexcept -> std::vector<AllocatorStats::Snapshot>
+{
+	Registry& registry = GetRegistry();
+	std::lock_guard lock(registry.lock);
+	std::vector<AllocatorStats::Snapshot> out(registry.allocators.size());
+	for (size_t i = 0; i < out.size(); ++i)
+		registry.allocators[i]->GetStatsSnapshot(out[i]);
+	return out;
+}
+#endif
\ No newline at end of file
@@ -3,6 +3,20 @@
 #include "memutils.h"
 #include "errors.h"
 
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <utility>
+
+namespace
+{
+	// the allocator's pages may be large pages, but memory_map.h counts commits in normal pages
+	inline size_t ToSystemPages(size_t pages, size_t pageSize) noexcept
+	{
+		return pages * (pageSize / mm::get_page_size());
+	}
+}
+
 ggp::BlockAllocator::BlockAllocator(const Options& options) noexcept
 {
 	gassert(options.maxBytes > 0, "Block allocator max capacity may not be zero");
@@ -10,19 +24,34 @@ ggp::BlockAllocator::BlockAllocator(const Options& options) noexcept
 	static_assert(1 << 3 == alignof(EmptyBlock), "block allocator enforces alignment for empty blocks by requiring that the exponent is at least 3, but that doesnt match empty block alignment.");
 	gassert(options.minimumAlignmentExponent >= 3 && options.minimumAlignmentExponent <= 7, "Alignment requested from block allocator is too small or too large");
 	m_minAlignmentExponent = options.minimumAlignmentExponent;
+	m_concurrency = options.concurrency;
+	m_trimPolicy = options.trimPolicy;
+	m_allocationPolicy = options.allocationPolicy;
+	abort_if(m_trimPolicy != TrimPolicy::Never && m_concurrency == Concurrency::LockFree,
+		"block allocator cannot decommit pages while in lock-free mode");
+	abort_if(m_allocationPolicy != AllocationPolicy::FreeList && m_concurrency == Concurrency::LockFree,
+		"block allocator can only use a free list while in lock-free mode");
 	m_pageSize = mm::get_page_size();
-	m_blockSize = max(options.blockSize, sizeof EmptyBlock); // NOTE: macro preventing me from using std::max? :(
+	// if the OS cant give us large pages, silently fall back to normal ones
+	if (options.largePages && mm::get_large_page_size() != 0)
+		m_pageSize = mm::get_large_page_size();
+	const bool usingLargePages = m_pageSize != mm::get_page_size();
+	// parenthesized so that the windows.h max macro does not get expanded
+	m_blockSize = (std::max)(options.blockSize, sizeof(EmptyBlock));
 	m_blockSize = rround_up_to_multiple_of(m_blockSize, u64(1UL) << u8(options.minimumAlignmentExponent));
 	const size_t pagesReserved = rround_up_to_multiple_of(options.maxBytes, m_pageSize) / m_pageSize;
 	const size_t bytesCommitted = options.initialBytes == 0 ? 0 : rround_up_to_multiple_of(options.initialBytes, m_pageSize);
 	const size_t pagesCommitted = bytesCommitted / m_pageSize;
+	m_minimumPages = pagesCommitted;
 
 	const size_t maxPossibleBlocks = (pagesReserved * m_pageSize) / m_blockSize;
 	gassert(maxPossibleBlocks > 0);
+	gassert(maxPossibleBlocks < nullIndex, "block allocator too large to be indexed by u32");
 
-	if (auto result = mm::reserve_pages(nullptr, pagesReserved); result.code != 0)
+	if (auto result = usingLargePages ? mm::reserve_large_pages(nullptr, pagesReserved) : mm::reserve_pages(nullptr, pagesReserved);
+		result.code != 0)
 	{
-		printf("ERROR: Failed to reserve memory for block allocator, errcode %lld\n", result.code);
+		printf("ERROR: Failed to reserve memory for block allocator, errcode %" PRId64 "\n", result.code);
 		gabort();
 	}
 	else
@@ -31,13 +60,13 @@ ggp::BlockAllocator::BlockAllocator(const Options& options) noexcept
 	
 		if (bytesCommitted > 0)
 		{
-			if (auto commitResult = mm::commit_pages(result.data, pagesCommitted); commitResult == 0)
+			if (auto commitResult = mm::commit_pages(result.data, ToSystemPages(pagesCommitted, m_pageSize)); commitResult == 0)
 			{
 				m_memory = std::span<u8>{ (u8*)result.data, bytesCommitted };
 			}
 			else
 			{
-				printf("ERROR: Failed to commit memory for block allocator, errcode %lld\n", commitResult);
+				printf("ERROR: Failed to commit memory for block allocator, errcode %" PRId64 "\n", commitResult);
 				gabort();
 			}
 		}
@@ -49,7 +78,7 @@ ggp::BlockAllocator::BlockAllocator(const Options& options) noexcept
 
 	// memory allocated, now initialize if needed
 	const size_t initialBlocks = bytesCommitted / m_blockSize;
-	gassert(m_blockSize >= sizeof EmptyBlock);
+	gassert(m_blockSize >= sizeof(EmptyBlock));
 	for (size_t i = 0; i < initialBlocks; ++i) {
 		EmptyBlock* addr = reinterpret_cast<EmptyBlock*>(m_memory.data() + (i * m_blockSize));
 		gassert(is_aligned_to_type(addr));
@@ -59,79 +88,312 @@ ggp::BlockAllocator::BlockAllocator(const Options& options) noexcept
 	}
 	m_blocksFree = initialBlocks;
 	m_lastFree = 0;
+
+	if (m_trimPolicy != TrimPolicy::Never)
+		m_pageLiveCounts.resize(pagesReserved, 0);
+
+	if (m_allocationPolicy == AllocationPolicy::LowestAddress)
+	{
+		m_freeBits.Resize(maxPossibleBlocks);
+		m_freeBits.SetRange(0, initialBlocks);
+	}
+
+	// lock-free mode has no count to go off of, so the list needs an explicit end
+	if (initialBlocks > 0)
+		GetBlockAt(initialBlocks - 1)->nextEmpty = nullIndex;
+	m_freeHead.store(PackHead(initialBlocks > 0 ? 0 : nullIndex, 0), std::memory_order_relaxed);
+
+#if GGP_ALLOCATOR_STATS
+	m_debugName = options.debugName;
+	m_stats.SetReserved(m_reservedMemory.size_bytes());
+	m_stats.SetCommitted(m_memory.size_bytes());
+	AllocatorRegistry::Register(this);
+#endif
+
+	m_precommitAhead = options.precommitAhead;
+	if (m_precommitAhead)
+		StartPrecommitThread();
 }
 
 ggp::BlockAllocator::BlockAllocator(BlockAllocator&& other) noexcept
-	:m_memory(std::exchange(other.m_memory, {})),
+	// the other allocator's precommit thread has to be stopped before anything is taken from it
+	:m_memory((other.StopPrecommitThread(), std::exchange(other.m_memory, {}))),
 	m_reservedMemory(std::exchange(other.m_reservedMemory, {})),
 	m_pageSize(other.m_pageSize),
 	m_blocksFree(other.m_blocksFree),
 	m_blockSize(other.m_blockSize),
 	m_lastFree(other.m_lastFree),
-	m_minAlignmentExponent(other.m_minAlignmentExponent)
+	m_minimumPages(other.m_minimumPages),
+	m_minAlignmentExponent(other.m_minAlignmentExponent),
+	m_concurrency(other.m_concurrency),
+	m_trimPolicy(other.m_trimPolicy),
+	m_allocationPolicy(other.m_allocationPolicy),
+	m_freeBits(std::move(other.m_freeBits)),
+	m_pageLiveCounts(std::move(other.m_pageLiveCounts)),
+	m_freeHead(other.m_freeHead.load(std::memory_order_relaxed)),
+	m_precommitAhead(other.m_precommitAhead)
 {
+#if GGP_ALLOCATOR_STATS
+	m_debugName = other.m_debugName;
+	m_stats.TakeFrom(other.m_stats);
+	// the moved-from allocator is empty, so it shouldnt show up anymore
+	AllocatorRegistry::Unregister(&other);
+	AllocatorRegistry::Register(this);
+#endif
+	if (m_precommitAhead)
+		StartPrecommitThread();
 }
 
 auto ggp::BlockAllocator::operator=(BlockAllocator&& other) noexcept -> BlockAllocator&
 {
-	this->~BlockAllocator(); // release our memory
+	if (this == &other)
+		return *this;
+	Release();
+	other.StopPrecommitThread();
 	m_memory = std::exchange(other.m_memory, {});
 	m_reservedMemory = std::exchange(other.m_reservedMemory, {});
 	m_pageSize = other.m_pageSize;
 	m_blocksFree = other.m_blocksFree;
 	m_blockSize = other.m_blockSize;
 	m_lastFree = other.m_lastFree;
+	m_minimumPages = other.m_minimumPages;
 	m_minAlignmentExponent = other.m_minAlignmentExponent;
+	m_concurrency = other.m_concurrency;
+	m_trimPolicy = other.m_trimPolicy;
+	m_allocationPolicy = other.m_allocationPolicy;
+	m_freeBits = std::move(other.m_freeBits);
+	m_pageLiveCounts = std::move(other.m_pageLiveCounts);
+	m_freeHead.store(other.m_freeHead.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	m_precommitAhead = other.m_precommitAhead;
+#if GGP_ALLOCATOR_STATS
+	// Release() unregistered us above
+	m_debugName = other.m_debugName;
+	m_stats.TakeFrom(other.m_stats);
+	// the moved-from allocator is empty, so it shouldnt show up anymore
+	AllocatorRegistry::Unregister(&other);
+	AllocatorRegistry::Register(this);
+#endif
+	if (m_precommitAhead)
+		StartPrecommitThread();
 	return *this;
 }
 
 ggp::BlockAllocator::~BlockAllocator() noexcept
 {
-	mm::memory_unmap(m_reservedMemory.data(), m_reservedMemory.size_bytes());
+	Release();
+}
+
+void ggp::BlockAllocator::Release() noexcept
+{
+	GGP_ALLOCATOR_STAT(AllocatorRegistry::Unregister(this));
+	StopPrecommitThread();
+	if (!m_reservedMemory.empty())
+		mm::memory_unmap(m_reservedMemory.data(), m_reservedMemory.size_bytes());
+	m_reservedMemory = {};
+	m_memory = {};
 }
 
 std::span<u8> ggp::BlockAllocator::Alloc() noexcept
+{
+	switch (m_concurrency)
+	{
+	case Concurrency::Locked:
+	{
+		std::lock_guard lock(m_sharedLock);
+		return AllocUnsynchronized();
+	}
+	case Concurrency::LockFree:
+		return AllocLockFree();
+	default:
+		return AllocUnsynchronized();
+	}
+}
+
+std::span<u8> ggp::BlockAllocator::AllocUnsynchronized() noexcept
 {
 	if (m_blocksFree == 0)
+	{
 		if (!GrowCapacity())
+		{
+			GGP_ALLOCATOR_STAT(m_stats.OnFailedAlloc());
 			return {};
+		}
+	}
+
+	if (m_allocationPolicy == AllocationPolicy::LowestAddress)
+	{
+		const size_t index = m_freeBits.FindFirstSet();
+		gassert(index != HierarchicalBitset::npos, "free block count out of sync with free bitmap");
+		m_freeBits.Clear(index);
+		--m_blocksFree;
+		if (m_trimPolicy != TrimPolicy::Never)
+			UpdatePageOccupancy(index, 1);
+		GGP_ALLOCATOR_STAT(m_stats.OnAlloc(1));
+		return { (u8*)GetBlockAt(index), m_blockSize };
+	}
 
 	EmptyBlock* const lastFree = GetBlockAt(m_lastFree);
 
 	--m_blocksFree;
+	if (m_trimPolicy != TrimPolicy::Never)
+		UpdatePageOccupancy(m_lastFree, 1);
 	m_lastFree = lastFree->nextEmpty;
+	GGP_ALLOCATOR_STAT(m_stats.OnAlloc(1));
 
 	return { (u8*)lastFree, m_blockSize };
 }
 
-bool ggp::BlockAllocator::GrowCapacity() noexcept
+bool ggp::BlockAllocator::AllocN(std::span<u8*> out) noexcept
 {
-	if (m_memory.size() == m_reservedMemory.size())
+	if (out.empty())
+		return true;
+
+	switch (m_concurrency)
+	{
+	case Concurrency::Locked:
+	{
+		std::lock_guard lock(m_sharedLock);
+		if (!ReserveFreeBlocks(out.size()))
+			return false;
+		PopBlocksUnsynchronized(out);
+		return true;
+	}
+	case Concurrency::LockFree:
+	{
+		// popping a whole chain in one CAS would need to read every link while racing other
+		// threads, so just pop them one at a time
+		for (size_t i = 0; i < out.size(); ++i)
+		{
+			std::span<u8> block = AllocLockFree();
+			if (block.empty()) [[unlikely]]
+			{
+				FreeN(out.first(i));
+				return false;
+			}
+			out[i] = block.data();
+		}
+		return true;
+	}
+	default:
+		if (!ReserveFreeBlocks(out.size()))
+			return false;
+		PopBlocksUnsynchronized(out);
+		return true;
+	}
+}
+
+void ggp::BlockAllocator::PopBlocksUnsynchronized(std::span<u8*> out) noexcept
+{
+	gassert(out.size() <= m_blocksFree);
+	for (u8*& block : out)
+	{
+		size_t index;
+		if (m_allocationPolicy == AllocationPolicy::LowestAddress)
+		{
+			index = m_freeBits.FindFirstSet();
+			gassert(index != HierarchicalBitset::npos, "free block count out of sync with free bitmap");
+			m_freeBits.Clear(index);
+		}
+		else
+		{
+			// right after a grow the head of the list is the new range in ascending order, so this
+			// hands out a contiguous run
+			index = m_lastFree;
+			m_lastFree = GetBlockAt(index)->nextEmpty;
+		}
+		if (m_trimPolicy != TrimPolicy::Never)
+			UpdatePageOccupancy(index, 1);
+		block = (u8*)GetBlockAt(index);
+	}
+	m_blocksFree -= out.size();
+	GGP_ALLOCATOR_STAT(m_stats.OnAlloc(out.size()));
+}
+
+bool ggp::BlockAllocator::ReserveFreeBlocks(size_t count) noexcept
+{
+	if (m_blocksFree >= count)
+		return true;
+
+	const size_t usedBlocks = (m_memory.size_bytes() / m_blockSize) - m_blocksFree;
+	const size_t neededBytes = (usedBlocks + count) * m_blockSize;
+	const size_t neededPages = rround_up_to_multiple_of(neededBytes, m_pageSize) / m_pageSize;
+	// GrowCapacity caps this at the reserved size
+	GrowCapacity(neededPages);
+	if (m_blocksFree < count)
+	{
+		GGP_ALLOCATOR_STAT(m_stats.OnFailedAlloc());
 		return false;
+	}
+	return true;
+}
 
+size_t ggp::BlockAllocator::NextGrowthPages(size_t committedPages, size_t minimumPages) const noexcept
+{
 	// grow by 2x, not necessarily the best? but it works
 	// if started at 0, start with only one block
-	const size_t newSizePages = max(1, (m_memory.size_bytes() / m_pageSize) * 2);
+	const size_t newSizePages = (std::max)(minimumPages, (std::max)(size_t(1), committedPages * 2));
 
 	const size_t reservedPages = m_reservedMemory.size_bytes() / m_pageSize;
-	const size_t cappedSizePages = min(newSizePages, reservedPages); // cap out at reservedPages
+	return (std::min)(newSizePages, reservedPages); // cap out at reservedPages
+}
+
+bool ggp::BlockAllocator::GrowCapacity(size_t minimumPages) noexcept
+{
+	if (m_memory.size() == m_reservedMemory.size())
+		return false;
+
+	const size_t cappedSizePages = NextGrowthPages(m_memory.size_bytes() / m_pageSize, minimumPages);
 
-	auto result = mm::commit_pages(m_memory.data(), cappedSizePages);
+	// if the precommit thread is still working on this growth, waiting for it is still cheaper than
+	// doing it all over again
+	std::unique_lock precommitLock(m_precommitLock, std::defer_lock);
+	if (m_precommitThread.joinable())
+		precommitLock.lock();
+	const bool precommitted = m_precommitThread.joinable()
+		&& m_precommitStart == m_memory.size_bytes()
+		&& m_precommitEnd >= cappedSizePages * m_pageSize;
 
-	if (result != 0)
+	if (!precommitted)
 	{
-		// could return false here?
-		printf("ERROR: memory page commit failure, errcode %lld\n", result);
-		gabort();
+		auto result = mm::commit_pages(m_memory.data(), ToSystemPages(cappedSizePages, m_pageSize));
+
+		if (result != 0)
+		{
+			// could return false here?
+			printf("ERROR: memory page commit failure, errcode %" PRId64 "\n", result);
+			gabort();
+		}
 	}
 
 	const size_t oldNumBlocks = m_memory.size_bytes() / m_blockSize;
 	const size_t newNumBlocks = (cappedSizePages * m_pageSize) / m_blockSize;
+	GGP_ALLOCATOR_STAT(m_stats.OnGrow(m_memory.size_bytes(), cappedSizePages * m_pageSize));
 	m_memory = { m_reservedMemory.data(), cappedSizePages * m_pageSize };
+	m_blocksFree += newNumBlocks - oldNumBlocks;
 
-	for (size_t i = oldNumBlocks; i < newNumBlocks; ++i)
+	if (m_precommitThread.joinable())
 	{
-		GetBlockAt(i)->nextEmpty = i + 1;
+		// get the step after this one ready before it is needed
+		m_precommitStart = m_memory.size_bytes();
+		m_precommitEnd = m_precommitStart;
+		m_precommitRequested = true;
+		precommitLock.unlock();
+		m_precommitSignal.notify_one();
+	}
+
+	if (m_allocationPolicy == AllocationPolicy::LowestAddress)
+	{
+		m_freeBits.SetRange(oldNumBlocks, newNumBlocks);
+		return true;
+	}
+
+	// the precommit thread already linked the new blocks to each other
+	if (!precommitted)
+	{
+		for (size_t i = oldNumBlocks; i < newNumBlocks; ++i)
+		{
+			GetBlockAt(i)->nextEmpty = i + 1;
+		}
 	}
 
 	// we will start allocating into the newly allocated row of blocks, not
@@ -140,11 +402,151 @@ bool ggp::BlockAllocator::GrowCapacity() noexcept
 	GetBlockAt(newNumBlocks - 1)->nextEmpty = m_lastFree;
 	m_lastFree = oldNumBlocks;
 
-	m_blocksFree += newNumBlocks - oldNumBlocks;
+	return true;
+}
+
+void ggp::BlockAllocator::StartPrecommitThread() noexcept
+{
+	gassert(!m_precommitThread.joinable());
+	m_precommitStop = false;
+	// prepare the first growth straight away
+	m_precommitStart = m_memory.size_bytes();
+	m_precommitEnd = m_precommitStart;
+	m_precommitRequested = true;
+	m_precommitThread = std::thread([this] { PrecommitThreadMain(); });
+}
+
+void ggp::BlockAllocator::StopPrecommitThread() noexcept
+{
+	if (!m_precommitThread.joinable())
+		return;
+	{
+		std::lock_guard lock(m_precommitLock);
+		m_precommitStop = true;
+	}
+	m_precommitSignal.notify_one();
+	m_precommitThread.join();
+}
+
+void ggp::BlockAllocator::PrecommitThreadMain() noexcept
+{
+	std::unique_lock lock(m_precommitLock);
+	while (true)
+	{
+		m_precommitSignal.wait(lock, [this] { return m_precommitRequested || m_precommitStop; });
+		if (m_precommitStop)
+			return;
+		m_precommitRequested = false;
+
+		// the lock is held throughout, so GrowCapacity waits for this instead of racing it. everything
+		// touched here is past the end of m_memory, which the allocating threads never look at
+		const size_t committedPages = m_precommitStart / m_pageSize;
+		const size_t targetPages = NextGrowthPages(committedPages, 0);
+		if (targetPages <= committedPages)
+			continue; // already at max
+
+		u8* const start = m_reservedMemory.data() + m_precommitStart;
+		const size_t systemPages = ToSystemPages(targetPages - committedPages, m_pageSize);
+		if (auto result = mm::commit_pages(start, systemPages); result != 0)
+		{
+			// leave it to GrowCapacity, which will report the error if it happens again
+			printf("WARNING: block allocator precommit failed, errcode %" PRId64 "\n", result);
+			continue;
+		}
+		if (auto result = mm::prefault_pages(start, systemPages); result != 0)
+			printf("WARNING: block allocator prefault failed, errcode %" PRId64 "\n", result);
+
+		if (m_allocationPolicy == AllocationPolicy::FreeList)
+		{
+			const size_t oldNumBlocks = m_precommitStart / m_blockSize;
+			const size_t newNumBlocks = (targetPages * m_pageSize) / m_blockSize;
+			for (size_t i = oldNumBlocks; i < newNumBlocks; ++i)
+				GetReservedBlockAt(i)->nextEmpty = i + 1;
+		}
+		m_precommitEnd = targetPages * m_pageSize;
+	}
+}
+
+std::span<u8> ggp::BlockAllocator::AllocLockFree() noexcept
+{
+	u64 head = m_freeHead.load(std::memory_order_acquire);
+	while (true)
+	{
+		const u32 index = HeadIndex(head);
+		if (index == nullIndex) [[unlikely]]
+		{
+			if (!GrowCapacityLockFree())
+			{
+				GGP_ALLOCATOR_STAT(m_stats.OnFailedAlloc());
+				return {};
+			}
+			head = m_freeHead.load(std::memory_order_acquire);
+			continue;
+		}
 
+		EmptyBlock* const block = GetReservedBlockAt(index);
+		// this block may have already been popped and written to by another thread, in which case this
+		// read is garbage- but then the tag will have changed and the CAS below fails
+		const u64 next = std::atomic_ref(block->nextEmpty).load(std::memory_order_relaxed);
+		if (m_freeHead.compare_exchange_weak(head, PackHead(u32(next), HeadTag(head) + 1),
+			std::memory_order_acquire, std::memory_order_acquire))
+		{
+			GGP_ALLOCATOR_STAT(m_stats.OnAlloc(1));
+			return { (u8*)block, m_blockSize };
+		}
+	}
+}
+
+void ggp::BlockAllocator::FreeLockFree(std::span<u8> mem) noexcept
+{
+	if (!IsValidBlock(mem, m_reservedMemory))
+		return;
+
+	const u32 index = GetReservedIndex(mem.data());
+	PushChainLockFree(index, index);
+	GGP_ALLOCATOR_STAT(m_stats.OnFree(1));
+}
+
+void ggp::BlockAllocator::PushChainLockFree(u32 first, u32 last) noexcept
+{
+	std::atomic_ref lastNext(GetReservedBlockAt(last)->nextEmpty);
+	u64 head = m_freeHead.load(std::memory_order_relaxed);
+	do
+	{
+		lastNext.store(HeadIndex(head), std::memory_order_relaxed);
+	} while (!m_freeHead.compare_exchange_weak(head, PackHead(first, HeadTag(head) + 1),
+		std::memory_order_release, std::memory_order_relaxed));
+}
+
+bool ggp::BlockAllocator::GrowCapacityLockFree() noexcept
+{
+	std::lock_guard lock(m_sharedLock);
+
+	// somebody else may have grown (or freed something) while we waited for the lock
+	if (HeadIndex(m_freeHead.load(std::memory_order_acquire)) != nullIndex)
+		return true;
+
+	const size_t oldNumBlocks = m_memory.size_bytes() / m_blockSize;
+	// reuses the single threaded growth, but its free list splice is thrown out: the new range of
+	// blocks is already linked i -> i + 1, it just needs an end and then to be published
+	const size_t lastFree = m_lastFree;
+	if (!GrowCapacity())
+		return false;
+	m_lastFree = lastFree;
+
+	const size_t newNumBlocks = m_memory.size_bytes() / m_blockSize;
+	gassert(newNumBlocks > oldNumBlocks);
+	PushChainLockFree(u32(oldNumBlocks), u32(newNumBlocks - 1));
 	return true;
 }
 
+auto ggp::BlockAllocator::GetReservedBlockAt(size_t i) const noexcept -> EmptyBlock*
+{
+	EmptyBlock* const out = (EmptyBlock*)(m_reservedMemory.data() + (m_blockSize * i));
+	gassert(is_inbounds_bytes(m_reservedMemory, out), "attempt to get out of bounds of block allocator");
+	return out;
+}
+
 auto ggp::BlockAllocator::GetBlockAt(size_t i) const noexcept -> EmptyBlock* 
 {
 	EmptyBlock* const out = (EmptyBlock*)(m_memory.data() + (m_blockSize * i));
@@ -155,20 +557,439 @@ auto ggp::BlockAllocator::GetBlockAt(size_t i) const noexcept -> EmptyBlock*
 
 void ggp::BlockAllocator::Free(std::span<u8> mem) noexcept
 {
+	switch (m_concurrency)
 	{
-		const bool wrong_size = mem.size() != m_blockSize;
-		const bool outside_allocator = !memcontains(m_memory, mem);
-		const bool misaligned = (mem.data() - m_memory.data()) % m_blockSize != 0;
-		if (wrong_size || outside_allocator || misaligned) {
-			fprintf(stderr, "WARNING: Invalid memory passed to block allocator for free\n");
-			return;
-		}
+	case Concurrency::Locked:
+	{
+		std::lock_guard lock(m_sharedLock);
+		FreeUnsynchronized(mem);
+		return;
+	}
+	case Concurrency::LockFree:
+		FreeLockFree(mem);
+		return;
+	default:
+		FreeUnsynchronized(mem);
+		return;
 	}
+}
+
+bool ggp::BlockAllocator::IsValidBlock(std::span<u8> mem, std::span<u8> range) const noexcept
+{
+	const bool wrong_size = mem.size() != m_blockSize;
+	const bool outside_allocator = !memcontains(range, mem);
+	const bool misaligned = (mem.data() - range.data()) % m_blockSize != 0;
+	if (wrong_size || outside_allocator || misaligned) {
+		fprintf(stderr, "WARNING: Invalid memory passed to block allocator for free\n");
+		GGP_ALLOCATOR_STAT(m_stats.OnInvalidFree());
+		return false;
+	}
+	return true;
+}
+
+void ggp::BlockAllocator::FreeUnsynchronized(std::span<u8> mem) noexcept
+{
+	if (!IsValidBlock(mem, m_memory))
+		return;
 
 	const ptrdiff_t diff = mem.data() - m_memory.data();
 	const size_t index = diff / m_blockSize;
 
-	GetBlockAt(index)->nextEmpty = m_lastFree;
-	m_lastFree = index;
+	if (m_allocationPolicy == AllocationPolicy::LowestAddress)
+	{
+		if (m_freeBits.Test(index)) [[unlikely]]
+		{
+			fprintf(stderr, "WARNING: Double free of block %zu in block allocator\n", index);
+			GGP_ALLOCATOR_STAT(m_stats.OnInvalidFree());
+			return;
+		}
+		m_freeBits.Set(index);
+	}
+	else
+	{
+		GetBlockAt(index)->nextEmpty = m_lastFree;
+		m_lastFree = index;
+	}
 	++m_blocksFree;
+	GGP_ALLOCATOR_STAT(m_stats.OnFree(1));
+
+	if (m_trimPolicy != TrimPolicy::Never)
+	{
+		const bool emptiedPage = UpdatePageOccupancy(index, -1);
+		const size_t totalBlocks = m_memory.size_bytes() / m_blockSize;
+		if (m_trimPolicy == TrimPolicy::Automatic && emptiedPage && m_blocksFree * 4 >= totalBlocks * 3)
+			TrimUnsynchronized();
+	}
+}
+
+bool ggp::BlockAllocator::UpdatePageOccupancy(size_t blockIndex, i32 delta) noexcept
+{
+	// blocks do not have to divide evenly into pages, so one block may be counted by two pages
+	const size_t firstByte = blockIndex * m_blockSize;
+	const size_t firstPage = firstByte / m_pageSize;
+	const size_t lastPage = (firstByte + m_blockSize - 1) / m_pageSize;
+	bool emptied = false;
+	for (size_t page = firstPage; page <= lastPage; ++page)
+	{
+		gassert(delta > 0 || m_pageLiveCounts[page] > 0, "page live count underflow");
+		m_pageLiveCounts[page] += delta;
+		emptied |= m_pageLiveCounts[page] == 0;
+	}
+	return emptied;
+}
+
+size_t ggp::BlockAllocator::Trim() noexcept
+{
+	gassert(m_trimPolicy != TrimPolicy::Never, "Trim() called on block allocator which does not track page occupancy");
+	if (m_trimPolicy == TrimPolicy::Never)
+		return 0;
+
+	if (m_concurrency == Concurrency::Locked)
+	{
+		std::lock_guard lock(m_sharedLock);
+		return TrimUnsynchronized();
+	}
+	return TrimUnsynchronized();
+}
+
+size_t ggp::BlockAllocator::TrimUnsynchronized() noexcept
+{
+	const size_t committedPages = m_memory.size_bytes() / m_pageSize;
+
+	// find the end of the last page that anything is living in
+	size_t usedPages = committedPages;
+	while (usedPages > 0 && m_pageLiveCounts[usedPages - 1] == 0)
+		--usedPages;
+
+	// hysteresis: keep 50% slack past the used pages, otherwise a trim right after a grow would
+	// cause the next allocation to grow again
+	const size_t targetPages = (std::max)(usedPages + (usedPages / 2), m_minimumPages);
+	if (targetPages >= committedPages)
+		return 0;
+
+	// unlink any free blocks which are about to be decommitted. blocks straddling the new end are
+	// dropped too, same as how GrowCapacity only counts blocks that fit entirely
+	const size_t newNumBlocks = (targetPages * m_pageSize) / m_blockSize;
+	const size_t oldNumBlocks = m_memory.size_bytes() / m_blockSize;
+	const size_t releasedPages = committedPages - targetPages;
+	if (m_allocationPolicy == AllocationPolicy::LowestAddress)
+	{
+		// everything past the used pages is free, so all of those bits are set
+		gassert(m_freeBits.CountRange(newNumBlocks, oldNumBlocks) == oldNumBlocks - newNumBlocks);
+		m_freeBits.ClearRange(newNumBlocks, oldNumBlocks);
+		m_blocksFree -= oldNumBlocks - newNumBlocks;
+		DecommitTail(targetPages);
+		return releasedPages * m_pageSize;
+	}
+
+	size_t kept = 0;
+	size_t newHead = 0;
+	EmptyBlock* tail = nullptr;
+	size_t iter = m_lastFree;
+	for (size_t i = 0; i < m_blocksFree; ++i)
+	{
+		const size_t next = GetBlockAt(iter)->nextEmpty;
+		if (iter < newNumBlocks)
+		{
+			if (tail)
+				tail->nextEmpty = iter;
+			else
+				newHead = iter;
+			tail = GetBlockAt(iter);
+			++kept;
+		}
+		iter = next;
+	}
+
+	DecommitTail(targetPages);
+	m_blocksFree = kept;
+	m_lastFree = newHead;
+	return releasedPages * m_pageSize;
+}
+
+auto ggp::BlockAllocator::Compact() noexcept -> RelocationTable
+{
+	abort_if(m_concurrency == Concurrency::LockFree, "block allocator cannot compact while in lock-free mode");
+	if (m_concurrency == Concurrency::Locked)
+	{
+		std::lock_guard lock(m_sharedLock);
+		return CompactUnsynchronized();
+	}
+	return CompactUnsynchronized();
+}
+
+auto ggp::BlockAllocator::CompactUnsynchronized() noexcept -> RelocationTable
+{
+	const size_t numBlocks = m_memory.size_bytes() / m_blockSize;
+	RelocationTable out;
+	out.newIndices.resize(numBlocks, UINT32_MAX);
+
+	HierarchicalBitset listFreeBits;
+	const HierarchicalBitset& freeBits = GetFreeBits(listFreeBits);
+
+	const size_t liveBlocks = numBlocks - m_blocksFree;
+	out.liveBlocks = u32(liveBlocks);
+
+	for (size_t i = 0; i < numBlocks; ++i)
+		if (!freeBits.Test(i))
+			out.newIndices[i] = u32(i);
+
+	// walk down from the top, moving every live block past the end of the packed range into the
+	// lowest hole. there are exactly as many of those blocks as there are holes below liveBlocks
+	size_t low = 0;
+	for (size_t high = numBlocks; high-- > liveBlocks;)
+	{
+		if (freeBits.Test(high))
+			continue;
+		while (!freeBits.Test(low))
+			++low;
+		gassert(low < liveBlocks);
+
+		std::memcpy(GetBlockAt(low), GetBlockAt(high), m_blockSize);
+		out.newIndices[high] = u32(low);
+		++out.movedBlocks;
+		if (m_trimPolicy != TrimPolicy::Never)
+		{
+			UpdatePageOccupancy(high, -1);
+			UpdatePageOccupancy(low, 1);
+		}
+		++low;
+	}
+
+	// rebuild the free structure: everything from liveBlocks onwards is free, in ascending order
+	if (m_allocationPolicy == AllocationPolicy::LowestAddress)
+	{
+		m_freeBits.ClearRange(0, liveBlocks);
+		m_freeBits.SetRange(liveBlocks, numBlocks);
+	}
+	else
+	{
+		for (size_t i = liveBlocks; i < numBlocks; ++i)
+			GetBlockAt(i)->nextEmpty = i + 1;
+		m_lastFree = liveBlocks;
+	}
+
+	if (m_trimPolicy != TrimPolicy::Never)
+		TrimUnsynchronized();
+
+	return out;
+}
+
+void ggp::BlockAllocator::DecommitTail(size_t newCommittedPages) noexcept
+{
+	const size_t committedPages = m_memory.size_bytes() / m_pageSize;
+	gassert(newCommittedPages < committedPages);
+	size_t releasedPages = committedPages - newCommittedPages;
+
+	// throw away whatever the precommit thread prepared past the end as well, and dont let it
+	// prepare anything else until the allocator grows again
+	std::unique_lock precommitLock(m_precommitLock, std::defer_lock);
+	if (m_precommitThread.joinable())
+	{
+		precommitLock.lock();
+		gassert(m_precommitStart == m_memory.size_bytes());
+		releasedPages += (m_precommitEnd - m_precommitStart) / m_pageSize;
+		m_precommitStart = newCommittedPages * m_pageSize;
+		m_precommitEnd = m_precommitStart;
+		m_precommitRequested = false;
+	}
+
+	if (auto result = mm::decommit_pages(m_memory.data() + (newCommittedPages * m_pageSize), ToSystemPages(releasedPages, m_pageSize)); result != 0)
+	{
+		// the blocks in these pages were already forgotten about, so just leave them committed and unused
+		printf("ERROR: memory page decommit failure, errcode %" PRId64 "\n", result);
+	}
+	m_memory = { m_reservedMemory.data(), newCommittedPages * m_pageSize };
+	GGP_ALLOCATOR_STAT(m_stats.SetCommitted(m_memory.size_bytes()));
+}
+
+auto ggp::BlockAllocator::GetFreeBits(HierarchicalBitset& scratch) const noexcept -> const HierarchicalBitset&
+{
+	// the bitmap policy already knows which blocks are free, otherwise walk the list
+	if (m_allocationPolicy == AllocationPolicy::LowestAddress)
+		return m_freeBits;
+
+	scratch.Resize(m_memory.size_bytes() / m_blockSize);
+	size_t iter = m_lastFree;
+	for (size_t i = 0; i < m_blocksFree; ++i)
+	{
+		scratch.Set(iter);
+		iter = GetBlockAt(iter)->nextEmpty;
+	}
+	return scratch;
+}
+
+#if GGP_ALLOCATOR_STATS
+void ggp::BlockAllocator::GetStatsSnapshot(AllocatorStats::Snapshot& out) noexcept
+{
+	out.name = m_debugName ? m_debugName : "unnamed block allocator";
+	out.blockSize = m_blockSize;
+	m_stats.FillSnapshot(out);
+
+	switch (m_concurrency)
+	{
+	case Concurrency::Locked:
+	{
+		std::lock_guard lock(m_sharedLock);
+		out.fragmentation = MeasureFragmentationUnsynchronized();
+		return;
+	}
+	case Concurrency::LockFree:
+		out.fragmentation = -1.f;
+		return;
+	default:
+		out.fragmentation = MeasureFragmentationUnsynchronized();
+		return;
+	}
+}
+
+f32 ggp::BlockAllocator::MeasureFragmentationUnsynchronized() const noexcept
+{
+	if (m_blocksFree == 0)
+		return 0.f;
+
+	const size_t numBlocks = m_memory.size_bytes() / m_blockSize;
+	HierarchicalBitset listFreeBits;
+	const HierarchicalBitset& freeBits = GetFreeBits(listFreeBits);
+
+	// a free block is stranded if either page it touches has something live in it, since then
+	// neither Trim() nor the OS can take its memory back
+	std::vector<bool> pageInUse(m_memory.size_bytes() / m_pageSize, false);
+	for (size_t i = 0; i < numBlocks; ++i)
+	{
+		if (freeBits.Test(i))
+			continue;
+		pageInUse[(i * m_blockSize) / m_pageSize] = true;
+		pageInUse[(((i + 1) * m_blockSize) - 1) / m_pageSize] = true;
+	}
+
+	size_t stranded = 0;
+	for (size_t i = 0; i < numBlocks; ++i)
+	{
+		if (freeBits.Test(i) && (pageInUse[(i * m_blockSize) / m_pageSize] || pageInUse[(((i + 1) * m_blockSize) - 1) / m_pageSize]))
+			++stranded;
+	}
+	return f32(stranded) / f32(m_blocksFree);
+}
+#endif
+
+size_t ggp::BlockAllocator::RefillCache(std::span<u8*> out) noexcept
+{
+	gassert(m_concurrency != Concurrency::SingleThreaded, "ThreadCache used with a block allocator that is not thread safe");
+	size_t count = 0;
+	if (m_concurrency == Concurrency::LockFree)
+	{
+		for (; count < out.size(); ++count)
+		{
+			std::span<u8> block = AllocLockFree();
+			if (block.empty()) [[unlikely]]
+				break;
+			out[count] = block.data();
+		}
+		return count;
+	}
+
+	std::lock_guard lock(m_sharedLock);
+	ReserveFreeBlocks(out.size());
+	count = (std::min)(out.size(), m_blocksFree);
+	PopBlocksUnsynchronized(out.first(count));
+	return count;
+}
+
+void ggp::BlockAllocator::FreeN(std::span<u8* const> blocks) noexcept
+{
+	if (blocks.empty())
+		return;
+
+	switch (m_concurrency)
+	{
+	case Concurrency::Locked:
+	{
+		std::lock_guard lock(m_sharedLock);
+		for (u8* block : blocks)
+			FreeUnsynchronized({ block, m_blockSize });
+		return;
+	}
+	case Concurrency::LockFree:
+	{
+		// link the blocks to each other privately, then publish the whole chain at once
+		u8* first = nullptr;
+		u8* last = nullptr;
+		GGP_ALLOCATOR_STAT(size_t pushed = 0);
+		for (u8* block : blocks)
+		{
+			if (!IsValidBlock({ block, m_blockSize }, m_reservedMemory))
+				continue;
+			GGP_ALLOCATOR_STAT(++pushed);
+			if (last)
+			{
+				std::atomic_ref next(((EmptyBlock*)last)->nextEmpty);
+				next.store(GetReservedIndex(block), std::memory_order_relaxed);
+			}
+			else
+			{
+				first = block;
+			}
+			last = block;
+		}
+		if (first)
+			PushChainLockFree(GetReservedIndex(first), GetReservedIndex(last));
+		GGP_ALLOCATOR_STAT(m_stats.OnFree(pushed));
+		return;
+	}
+	default:
+		for (u8* block : blocks)
+			FreeUnsynchronized({ block, m_blockSize });
+		return;
+	}
+}
+
+ggp::BlockAllocator::ThreadCache::ThreadCache(BlockAllocator& allocator) noexcept
+	: m_allocator(&allocator)
+{
+	abort_if(allocator.m_concurrency == Concurrency::SingleThreaded, "ThreadCache requires a thread safe block allocator");
+}
+
+ggp::BlockAllocator::ThreadCache::~ThreadCache() noexcept
+{
+	Flush();
+}
+
+std::span<u8> ggp::BlockAllocator::ThreadCache::Alloc() noexcept
+{
+	if (m_count == 0) [[unlikely]]
+	{
+		m_count = m_allocator->RefillCache({ m_blocks.data(), batchSize });
+		if (m_count == 0)
+			return {};
+	}
+
+	--m_count;
+	return { m_blocks[m_count], m_allocator->m_blockSize };
+}
+
+void ggp::BlockAllocator::ThreadCache::Free(std::span<u8> mem) noexcept
+{
+	// only check against the reserved range, it cannot change while other threads are allocating
+	if (!m_allocator->IsValidBlock(mem, m_allocator->m_reservedMemory))
+		return;
+
+	if (m_count == capacity) [[unlikely]]
+	{
+		// give back the oldest half, keep the most recently freed (and likely still in cache) blocks
+		m_allocator->FreeN({ m_blocks.data(), batchSize });
+		std::copy(m_blocks.begin() + batchSize, m_blocks.end(), m_blocks.begin());
+		m_count -= batchSize;
+	}
+
+	m_blocks[m_count] = mem.data();
+	++m_count;
+}
+
+void ggp::BlockAllocator::ThreadCache::Flush() noexcept
+{
+	if (m_count == 0)
+		return;
+	m_allocator->FreeN({ m_blocks.data(), m_count });
+	m_count = 0;
 }
@@ -8,6 +8,7 @@
 #include "Texture.h"
 #include "memutils.h"
 #include "errors.h"
+#include "AllocatorStats.h"
 
 #include "imgui.h"
 #include "imgui_impl_dx11.h"
@@ -728,6 +729,8 @@ void ggp::Game::OnResize()
 
 void ggp::Game::Update(float deltaTime, float totalTime)
 {
+	m_frameArena.NewFrame();
+
 	if (Input::KeyDown(VK_ESCAPE))
 		Window::Quit();
 
@@ -755,7 +758,7 @@ void ggp::Game::UpdatePortalLocations() noexcept
 	// modify player view transform
 	Transform playerTransform = m_cameras.at(m_activeCamera)->GetTransform();
 	const XMVECTOR playerPosition = playerTransform.LoadPosition();
-	const XMVECTOR playerRotation = playerTransform.LoadEulerAngles();
+	const XMVECTOR playerRotation = playerTransform.LoadRotationQuat();
 
 	for (Portal& portal : m_portals)
 	{
@@ -764,7 +767,7 @@ void ggp::Game::UpdatePortalLocations() noexcept
 		Portal& connectedPortal = m_portals.at(portal.connectedPortalIndex.value());
 		const XMVECTOR portalToPlayerDistance = playerPosition - connectedPortal.transform->LoadPosition();
 		portal.camera->GetTransform().StorePosition(portal.transform->LoadPosition() + portalToPlayerDistance);
-		portal.camera->GetTransform().StoreEulerAngles(playerRotation);
+		portal.camera->GetTransform().StoreRotationQuat(playerRotation);
 		/*
 		Transform connectedLocation = m_portals.at(portal.connectedPortalIndex.value()).transform.value();
 		const XMMATRIX connnectedPortalWorldMatrixInverse =
@@ -796,13 +799,14 @@ void ggp::Game::BuildUI() noexcept
 
 	ImGui::Text("Framerate: %f", ImGui::GetIO().Framerate);
 	ImGui::Text("Window pixel dimensions: %d / %d", Window::Width(), Window::Height());
+	ImGui::Text("Transforms changed last frame: %zu", m_changedTransformCount);
 	ImGui::ColorEdit4("Background Color", m_backgroundColor.data(), 0);
 
 	ImGui::SliderInt("Blur radius", &m_blurRadius, 0, 100);
 
 	for (size_t i = 0; i < m_cameras.size(); ++i)
 	{
-		if (ImGui::RadioButton((std::string("Camera ") + std::to_string(i)).c_str(), m_activeCamera == i))
+		if (ImGui::RadioButton(m_frameArena.Current().Format("Camera %zu", i), m_activeCamera == i))
 			m_activeCamera = i;
 
 		Camera& cam = *m_cameras[i];
@@ -820,11 +824,8 @@ void ggp::Game::BuildUI() noexcept
 	*/
 
 	for (size_t i = 0; i < m_lights->size(); ++i) {
-		std::array<char, 64> buf;
-		int bytes_printed = std::snprintf(buf.data(), buf.size(), "light %zu", i);
-		gassert(bytes_printed < buf.size());
 		Light& light = (*m_lights)[i];
-		ImGui::ColorEdit3(buf.data(), &light.color.x);
+		ImGui::ColorEdit3(m_frameArena.Current().Format("light %zu", i), &light.color.x);
 		if (light.isShadowCaster) {
 			ImGui::Image((*m_shadowMapResources)[i]->shaderResourceView, { 512, 512 });
 		}
@@ -848,6 +849,8 @@ void ggp::Game::BuildUI() noexcept
 				Entity& entity = m_entities[i];
 				constexpr auto flags = ImGuiTreeNodeFlags_Leaf | ImGuiTreeNodeFlags_Bullet;
 
+				// static transforms are baked and cannot be moved
+				ImGui::BeginDisabled(entity.GetTransform().IsStatic());
 				XMFLOAT3 pos = entity.GetTransform().GetPosition();
 				if (ImGui::DragFloat3("Position", &pos.x, 0.01f, -1.f, 1.f)) {
 					entity.GetTransform().SetPosition(pos);
@@ -862,6 +865,7 @@ void ggp::Game::BuildUI() noexcept
 				if (ImGui::DragFloat3("Scale", &pos.x, 0.01f, -1.f, 1.f)) {
 					entity.GetTransform().SetScale(pos);
 				}
+				ImGui::EndDisabled();
 
 				if (entity.GetMesh())
 				{
@@ -886,6 +890,43 @@ void ggp::Game::BuildUI() noexcept
 		}
 	}
 
+#if GGP_ALLOCATOR_STATS
+	if (ImGui::CollapsingHeader("Allocators"))
+	{
+		constexpr f64 megabyte = 1024.0 * 1024.0;
+		const auto now = std::chrono::steady_clock::now();
+		const std::vector<AllocatorStats::Snapshot> allocators = AllocatorRegistry::SnapshotAll();
+		for (size_t i = 0; i < allocators.size(); ++i)
+		{
+			const AllocatorStats::Snapshot& stats = allocators[i];
+			// names are not unique, so use the index as the id
+			if (!ImGui::TreeNode((void*)i, "%s", stats.name))
+				continue;
+
+			ImGui::Text("Block size: %zu bytes", stats.blockSize);
+			ImGui::Text("Live blocks: %llu (peak %llu)", stats.liveBlocks, stats.peakLiveBlocks);
+			ImGui::Text("Committed: %.2f MB (peak %.2f MB) of %.2f MB reserved", stats.committedBytes / megabyte,
+				stats.peakCommittedBytes / megabyte, stats.reservedBytes / megabyte);
+			if (stats.fragmentation < 0.f)
+				ImGui::Text("Fragmentation: not measurable in lock-free mode");
+			else
+				ImGui::Text("Fragmentation: %.1f%% of free blocks stranded", stats.fragmentation * 100.f);
+			ImGui::Text("Failed allocations: %llu", stats.failedAllocations);
+			ImGui::Text("Invalid frees: %llu", stats.invalidFrees);
+			ImGui::Text("Grow events: %llu", stats.growCount);
+			// newest first
+			for (size_t e = stats.recentGrowEventCount; e-- > 0;)
+			{
+				const AllocatorStats::GrowEvent& event = stats.recentGrowEvents[e];
+				const f32 secondsAgo = std::chrono::duration<f32>(now - event.time).count();
+				ImGui::BulletText("%.1fs ago: %.2f MB -> %.2f MB", secondsAgo,
+					event.oldCommittedBytes / megabyte, event.newCommittedBytes / megabyte);
+			}
+			ImGui::TreePop();
+		}
+	}
+#endif
+
 	ImGui::End();
 }
 
@@ -900,6 +941,7 @@ void ggp::Game::RenderShadowMaps() noexcept
 	Graphics::Context->RSSetViewports(1, &viewport);
 	Graphics::Context->RSSetState(m_shadowMapRasterizerState.Get());
 
+	const TransformHierarchy::PublishedFrame frame = m_transformHierarchy->GetPublishedFrame();
 	// render all entities for every shadow map
 	for (size_t i = 0; i < m_lights->size(); ++i) {
 		const Light& light = (*m_lights)[i];
@@ -920,7 +962,7 @@ void ggp::Game::RenderShadowMaps() noexcept
 
 		for (auto& e : m_entities)
 		{
-			m_shadowMapVertexShader->SetMatrix4x4("world", *e.GetTransform().GetWorldMatrixPtr());
+			m_shadowMapVertexShader->SetMatrix4x4("world", *e.GetTransform().GetPublishedWorldMatrixPtr(frame));
 			m_shadowMapVertexShader->CopyAllBufferData();
 			if (e.GetMesh())
 				e.GetMesh()->BindBuffersAndDraw();
@@ -933,6 +975,9 @@ void ggp::Game::RenderShadowMaps() noexcept
 
 void ggp::Game::RenderSceneFull(const Camera& camera, float deltaTime, float totalTime) noexcept
 {
+	const XMFLOAT3 cameraPosition = camera.GetTransformRef().GetPosition();
+	// not const, reading the inverse transposes can fill them in
+	TransformHierarchy::PublishedFrame frame = m_transformHierarchy->GetPublishedFrame();
 	for (Entity& entity : m_entities)
 	{
 		if (!entity.GetMaterial() || !entity.GetMesh())
@@ -947,16 +992,16 @@ void ggp::Game::RenderSceneFull(const Camera& camera, float deltaTime, float tot
 			auto* vs = entity.GetMaterial()->GetVertexShader();
 			auto* ps = entity.GetMaterial()->GetPixelShader();
 
-			vs->SetMatrix4x4("world", *entity.GetTransform().GetWorldMatrixPtr());
+			vs->SetMatrix4x4("world", *entity.GetTransform().GetPublishedWorldMatrixPtr(frame));
 			vs->SetMatrix4x4("view", *camera.GetViewMatrix());
 			vs->SetMatrix4x4("projection", *camera.GetProjectionMatrix());
-			vs->SetMatrix4x4("worldInverseTranspose", *entity.GetTransform().GetWorldInverseTransposeMatrixPtr());
+			vs->SetMatrix4x4("worldInverseTranspose", *entity.GetTransform().GetPublishedWorldInverseTransposeMatrixPtr(frame));
 			vs->SetMatrix4x4("lightView", (*m_lights)[0].shadowView);
 			vs->SetMatrix4x4("lightProjection", (*m_lights)[0].shadowProjection);
 
 			ps->SetFloat4("colorTint", entity.GetMaterial()->GetColor());
 			ps->SetFloat("roughness", entity.GetMaterial()->GetRoughness());
-			ps->SetFloat3("cameraPosition", camera.GetTransformRef().GetPosition());
+			ps->SetFloat3("cameraPosition", cameraPosition);
 			ps->SetFloat("totalTime", totalTime);
 			ps->SetData("lights", m_lights->data(), u32(m_lights->size() * sizeof(Light)));
 			ps->SetFloat2("uvOffset", entity.GetMaterial()->GetUVOffset());
@@ -1045,6 +1090,14 @@ void ggp::Game::RenderSceneAndPortals(const Camera& camera, float delta, float t
 
 void ggp::Game::Draw(float deltaTime, float totalTime)
 {
+	// everything that moved this frame gets its world matrix recalculated at once, so the render
+	// passes below only read matrices. they read the published copy, which is what a separate render
+	// thread would see
+	m_transformHierarchy->UpdateAll(&m_workerPool);
+	m_transformHierarchy->PublishFrame();
+	// nothing caches per-object data yet, so the changes are only counted
+	m_changedTransformCount = m_transformHierarchy->ConsumeChanges().size();
+
 	RenderShadowMaps();
 
 	// Clear the back buffer (erase what's on screen) and depth buffer
@@ -0,0 +1,114 @@
+#include "LinearArena.h"
+#include "memory_map.h"
+#include "memutils.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdarg>
+#include <utility>
+
+ggp::LinearArena::LinearArena(const Options& options) noexcept
+{
+	gassert(options.maxBytes > 0, "Linear arena max capacity may not be zero");
+	gassert(options.initialBytes <= options.maxBytes, "Linear arena initial bytes greater than maximum possible bytes.");
+	m_pageSize = mm::get_page_size();
+	const size_t pagesReserved = rround_up_to_multiple_of(options.maxBytes, m_pageSize) / m_pageSize;
+	const size_t pagesCommitted = options.initialBytes == 0 ? 0 : rround_up_to_multiple_of(options.initialBytes, m_pageSize) / m_pageSize;
+
+	auto result = mm::reserve_pages(nullptr, pagesReserved);
+	if (result.code != 0)
+	{
+		printf("ERROR: Failed to reserve memory for linear arena, errcode %" PRId64 "\n", result.code);
+		gabort();
+	}
+	m_reservedMemory = std::span<u8>{ (u8*)result.data, result.bytes };
+	m_memory = std::span<u8>{ m_reservedMemory.data(), 0 };
+
+	if (pagesCommitted > 0)
+	{
+		if (auto commitResult = mm::commit_pages(result.data, pagesCommitted); commitResult != 0)
+		{
+			printf("ERROR: Failed to commit memory for linear arena, errcode %" PRId64 "\n", commitResult);
+			gabort();
+		}
+		m_memory = std::span<u8>{ m_reservedMemory.data(), pagesCommitted * m_pageSize };
+	}
+}
+
+ggp::LinearArena::LinearArena(LinearArena&& other) noexcept
+	:m_memory(std::exchange(other.m_memory, {})),
+	m_reservedMemory(std::exchange(other.m_reservedMemory, {})),
+	m_pageSize(other.m_pageSize),
+	m_used(std::exchange(other.m_used, 0))
+{
+}
+
+auto ggp::LinearArena::operator=(LinearArena&& other) noexcept -> LinearArena&
+{
+	if (this == &other)
+		return *this;
+	Release();
+	m_memory = std::exchange(other.m_memory, {});
+	m_reservedMemory = std::exchange(other.m_reservedMemory, {});
+	m_pageSize = other.m_pageSize;
+	m_used = std::exchange(other.m_used, 0);
+	return *this;
+}
+
+ggp::LinearArena::~LinearArena() noexcept
+{
+	Release();
+}
+
+void ggp::LinearArena::Release() noexcept
+{
+	if (m_reservedMemory.data())
+		mm::memory_unmap(m_reservedMemory.data(), m_reservedMemory.size_bytes());
+	m_reservedMemory = {};
+	m_memory = {};
+	m_used = 0;
+}
+
+bool ggp::LinearArena::Grow(size_t neededBytes) noexcept
+{
+	if (neededBytes > m_reservedMemory.size())
+	{
+		fprintf(stderr, "WARNING: linear arena out of reserved memory\n");
+		return false;
+	}
+
+	// same doubling as the block allocator, but jump straight to whatever is needed for big allocations
+	const size_t reservedPages = m_reservedMemory.size() / m_pageSize;
+	const size_t neededPages = rround_up_to_multiple_of(neededBytes, m_pageSize) / m_pageSize;
+	const size_t doubledPages = (std::max)(size_t(1), (m_memory.size() / m_pageSize) * 2);
+	const size_t newPages = (std::min)((std::max)(neededPages, doubledPages), reservedPages);
+
+	if (auto result = mm::commit_pages(m_memory.data(), newPages); result != 0)
+	{
+		printf("ERROR: memory page commit failure, errcode %" PRId64 "\n", result);
+		gabort();
+	}
+	m_memory = { m_reservedMemory.data(), newPages * m_pageSize };
+	return true;
+}
+
+const char* ggp::LinearArena::Format(const char* format, ...) noexcept
+{
+	va_list args;
+	va_start(args, format);
+	va_list argsCopy;
+	va_copy(argsCopy, args);
+	const int length = std::vsnprintf(nullptr, 0, format, argsCopy);
+	va_end(argsCopy);
+
+	char* const out = length < 0 ? nullptr : AllocArray<char>(size_t(length) + 1);
+	if (out)
+		std::vsnprintf(out, size_t(length) + 1, format, args);
+	va_end(args);
+	return out ? out : "";
+}
+
+ggp::FrameArena::FrameArena(const LinearArena::Options& options) noexcept
+	:m_arenas{ LinearArena(options), LinearArena(options) }
+{
+}
\ No newline at end of file
@@ -4,12 +4,16 @@
 #include "Texture.h"
 #include "Variant.h"
 #include "PathHelpers.h"
+#include "LinearArena.h"
+#include "ggp_pmr.h"
+#include "memutils.h"
 #include <array>
 #include <optional>
 #include <filesystem>
 #include <string>
 #include <ranges>
 #include <algorithm>
+#include <cstdlib>
 #include <DirectXMath.h>
 
 using namespace DirectX;
@@ -88,16 +92,20 @@ namespace ggp::MapParser
 		FaceUVExtra uvExtra;
 	};
 
+	// everything from here down to MapData is intermediate data which only lives during parse(), so
+	// it uses std::pmr containers which get their memory from parse()'s arena
+
 	struct Brush
 	{
-		std::vector<Face> faces;
+		std::pmr::vector<Face> faces;
 		XMFLOAT3 center;
 	};
 
 	struct MapEntity
 	{
-		dict<Variant> properties;
-		std::vector<Brush> brushes;
+		// every value in a .map file is a string, they only become Variants once they are handed out
+		std::pmr::unordered_map<std::pmr::string, std::pmr::string> properties;
+		std::pmr::vector<Brush> brushes;
 		XMFLOAT3 center;
 		OriginType originType = OriginType::BoundsCenter;
 	};
@@ -112,18 +120,18 @@ namespace ggp::MapParser
 
 	struct FaceGeometry
 	{
-		std::vector<FaceVertex> vertices;
-		std::vector<u32> indices;
+		std::pmr::vector<FaceVertex> vertices;
+		std::pmr::vector<u32> indices;
 	};
 
 	struct BrushGeometry
 	{
-		std::vector<FaceGeometry> faces;
+		std::pmr::vector<FaceGeometry> faces;
 	};
 
 	struct MapEntityGeometry
 	{
-		std::vector<BrushGeometry> brushes;
+		std::pmr::vector<BrushGeometry> brushes;
 	};
 
 	struct TextureData
@@ -135,8 +143,8 @@ namespace ggp::MapParser
 
 	struct MapData
 	{
-		std::vector<MapEntity> entities;
-		std::vector<MapEntityGeometry> entityGeometry;
+		std::pmr::vector<MapEntity> entities;
+		std::pmr::vector<MapEntityGeometry> entityGeometry;
 		std::vector<TextureData> textures;
 
 		u64 registerTexture(std::string_view name)
@@ -308,7 +316,7 @@ namespace ggp::MapParser
 
 		const bool isPhong = entity.properties.contains("_phong") && entity.properties.at("_phong") == "1";
 		const f32 phongAngle = entity.properties.contains("_phong_angle")
-			? std::stof(entity.properties.at("_phong_angle")) : 89.0f;
+			? std::strtof(entity.properties.at("_phong_angle").c_str(), nullptr) : 89.0f;
 
 		for (u64 f0 = 0; f0 < faceCount; ++f0)
 		{
@@ -475,7 +483,7 @@ namespace ggp::MapParser
 				break;
 			XMFLOAT3 vectorForm;
 			f32* start = &vectorForm.x;
-			const auto& originStr = entity.properties.at("origin").value<std::string>();
+			const auto& originStr = entity.properties.at("origin");
 			const auto floatToString = [](auto sv) -> f32 { return std::stof(std::string(std::cbegin(sv), std::cend(sv))); };
 			auto iter = originStr | std::views::split(' ') | std::views::transform(floatToString);
 			// write floats into vectorForm, stop when pointer goes over z
@@ -606,7 +614,7 @@ namespace ggp::MapParser
 		std::string_view textureName)
 	{
 		u32 indexOffset = 0;
-		std::vector<FaceGeometry> surfaces;
+		std::pmr::vector<FaceGeometry> surfaces;
 		for (u64 e = 0; e < map.entities.size(); ++e)
 		{
 			const MapEntity& entity = map.entities.at(e);
@@ -670,7 +678,8 @@ namespace ggp::MapParser
 				XMStoreFloat3(&vertices.back().Tangent, XMVectorSwizzle<1, 2, 0, 0>(XMLoadFloat4(&v.tangent)));
 				vertices.back().UV = v.uv;
 			}
-			out[i] = { std::move(vertices), std::move(fg.indices) };
+			// indices are copied out of the parse arena, they outlive it
+			out[i] = { std::move(vertices), std::vector<u32>(std::begin(fg.indices), std::end(fg.indices)) };
 		}
 
 		return out;
@@ -761,13 +770,20 @@ namespace ggp::MapParser
 		out.elements.reserve(map.entities.size()); // will need more than this, but at least this
 		
 		// entities which have no mesh and no material- they just represent map entities. their children are meshes
+		std::vector<Transform> entityTransforms;
+		out.mapRoot.GetTransform().AddChildren(u32(map.entities.size()), entityTransforms);
 		for (u64 e = 0; e < map.entities.size(); ++e)
 		{
 			const MapEntity& entity = map.entities.at(e);
-			Transform t = out.mapRoot.GetTransform().AddChild();
+			Transform t = entityTransforms.at(e);
 			t.SetPosition(entity.center);
+			// copied out of the parse arena, since the elements outlive it
+			dict<Variant> properties;
+			properties.reserve(entity.properties.size());
+			for (const auto& [key, value] : entity.properties)
+				properties.emplace(std::string(key), Variant(std::string(value)));
 			out.elements.emplace_back(
-				nullptr, nullptr, t, dict<Variant>(entity.properties), classnameForEntity(e));
+				nullptr, nullptr, t, std::move(properties), classnameForEntity(e));
 		}
 
 		for (const TextureData& tex : map.textures)
@@ -788,10 +804,13 @@ namespace ggp::MapParser
 				Mesh* meshRawPtr = uniqueMesh.get();
 				out.meshes[childName] = std::move(uniqueMesh);
 
+				// brushes never move once loaded
+				Transform brushTransform = parent.GetTransform().AddChild();
+				brushTransform.MarkStatic();
 				out.elements.emplace_back(
 					meshRawPtr,
 					out.materials.at(tex.name).get(),
-					parent.GetTransform().AddChild(),
+					brushTransform,
 					std::move(childName));
 			}
 		}
@@ -799,14 +818,20 @@ namespace ggp::MapParser
 
 	MapResult parse(std::ifstream& file, const MapSettings& settings)
 	{
+		// all the intermediate map data is allocated from here and thrown away at once when parsing is
+		// done, instead of freeing every face and brush one by one. must be declared before any of it
+		LinearArena parseArena(LinearArena::Options{ .maxBytes = 4_GB, .initialBytes = 1_MB });
+		ArenaMemoryResource parseResource(parseArena);
+		ScopedDefaultResource useParseResource(&parseResource);
+
 		auto scope = Scope::File;
 		bool isComment = false;
 		std::optional<u32> entityIndex;
 		std::optional<u32> brushIndex;
 		std::optional<u32> faceIndex;
 		std::optional<u32> componentIndex;
-		std::string propertyKey;
-		std::string currentProperty;
+		std::pmr::string propertyKey;
+		std::pmr::string currentProperty;
 		bool isValveUVs = false;
 		Face currentFace{};
 		Brush currentBrush{};
@@ -821,7 +846,7 @@ namespace ggp::MapParser
 
 		const auto submitCurrentEntityToMapData = [&]()
 		{
-			if (currentEntity.properties.contains(std::string("_tb_type")) && !mapData.entities.empty())
+			if (currentEntity.properties.contains("_tb_type") && !mapData.entities.empty())
 			{
 				auto& brushes = mapData.entities.front().brushes;
 				// append currentEntity.brushes to the back of brushes
@@ -969,7 +994,9 @@ namespace ggp::MapParser
 				if (isFirst && !currentProperty.empty())
 					currentProperty.clear();
 
-				currentProperty += std::string(token) + (!isLast ? " " : "");
+				currentProperty += token;
+				if (!isLast)
+					currentProperty += ' ';
 
 				if (isLast)
 				{
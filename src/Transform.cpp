@@ -51,11 +51,38 @@ auto ggp::Transform::AddChild() noexcept -> Transform
 	return hierarchy->AddChild(handle);
 }
 
+void ggp::Transform::AddChildren(u32 count, std::vector<Transform>& out) noexcept
+{
+	std::vector<Handle> handles;
+	hierarchy->AddChildren(handle, count, handles);
+	out.insert(out.end(), handles.begin(), handles.end());
+}
+
 void ggp::Transform::Destroy() noexcept
 {
 	return hierarchy->Destroy(handle);
 }
 
+void ggp::Transform::DestroySubtree() noexcept
+{
+	return hierarchy->DestroySubtree(handle);
+}
+
+void ggp::Transform::MarkStatic() noexcept
+{
+	hierarchy->MarkStatic(handle);
+}
+
+bool ggp::Transform::IsStatic() const noexcept
+{
+	return hierarchy->IsStatic(handle);
+}
+
+void ggp::Transform::Relocate(const BlockAllocator::RelocationTable& table) noexcept
+{
+	handle = TransformHierarchy::RelocateHandle(handle, table);
+}
+
 const XMFLOAT4X4* ggp::Transform::GetWorldMatrixPtr() noexcept
 {
 	return hierarchy->GetWorldMatrixPtr(handle);
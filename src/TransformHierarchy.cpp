@@ -2,267 +2,797 @@
 #include "TransformHierarchy.h"
 #include "memutils.h"
 
+#include <algorithm>
+#include <utility>
+
 using namespace DirectX;
 
-ggp::TransformHierarchy::TransformHierarchy() noexcept :m_transformAllocator(BlockAllocator::Options{
-	.maxBytes = 10_MB,
-		.initialBytes = 1_MB,
-		.blockSize = sizeof(InternalTransform),
-		.minimumAlignmentExponent = alignment_exponent(alignof(InternalTransform))
-})
+ggp::TransformHierarchy::TransformHierarchy() noexcept :m_scratch(LinearArena::Options{ .maxBytes = 1_MB }),
+	m_linkAllocator(BlockAllocator::Options{
+	.maxBytes = maxTransforms * sizeof(Links),
+		.initialBytes = 4096 * sizeof(Links),
+		.blockSize = sizeof(Links),
+		.minimumAlignmentExponent = alignment_exponent(alignof(Links)),
+		// keep transforms packed together, and let Compact() give memory back after a big unload
+		.trimPolicy = BlockAllocator::TrimPolicy::Manual,
+		.allocationPolicy = BlockAllocator::AllocationPolicy::LowestAddress,
+		.debugName = "transform hierarchy links",
+	}),
+	m_localArena(LinearArena::Options{ .maxBytes = maxTransforms * sizeof(LocalTransform) }),
+	m_worldArena(LinearArena::Options{ .maxBytes = maxTransforms * sizeof(XMFLOAT4X4A) }),
+	m_worldInverseTransposeArena(LinearArena::Options{ .maxBytes = maxTransforms * sizeof(XMFLOAT4X4A) }),
+	m_published{ CreatePublishedBuffer(), CreatePublishedBuffer() }
 {
+	// zero sized allocations to find where each array starts, EnsureCapacity grows them in place
+	m_locals = m_localArena.AllocArray<LocalTransform>(0);
+	m_worldMatrices = m_worldArena.AllocArray<XMFLOAT4X4A>(0);
+	m_worldInverseTransposeMatrices = m_worldInverseTransposeArena.AllocArray<XMFLOAT4X4A>(0);
 }
 
-auto ggp::TransformHierarchy::InsertTransform() noexcept -> Handle
+auto ggp::TransformHierarchy::CreatePublishedBuffer() noexcept -> PublishedBuffer
 {
-	auto* ptr = m_transformAllocator.Create<InternalTransform>();
-	return Handle(m_transformAllocator.GetIndexFromPointer(ptr));
+	PublishedBuffer buffer{
+		.worldArena = LinearArena(LinearArena::Options{ .maxBytes = maxTransforms * sizeof(XMFLOAT4X4A) }),
+		.worldInverseTransposeArena = LinearArena(LinearArena::Options{ .maxBytes = maxTransforms * sizeof(XMFLOAT4X4A) }),
+	};
+	// same as the main arrays, grown in place by PublishFrame
+	buffer.worldMatrices = buffer.worldArena.AllocArray<XMFLOAT4X4A>(0);
+	buffer.worldInverseTransposeMatrices = buffer.worldInverseTransposeArena.AllocArray<XMFLOAT4X4A>(0);
+	return buffer;
 }
 
-void ggp::TransformHierarchy::Destroy(Handle handle) noexcept
+void ggp::TransformHierarchy::EnsureCapacity(u32 index) noexcept
 {
-	auto* trans = GetPtr(handle);
+	if (index < m_capacity)
+		return;
+	abort_if(index >= maxTransforms, "Out of memory for transforms");
+
+	// double like a vector would, the arenas just commit more pages in place
+	const size_t wanted = (std::max)({ size_t(index) + 1, size_t(m_capacity) * 2, minimumCapacity });
+	const u32 newCapacity = u32((std::min)(wanted, maxTransforms));
+	const u32 added = newCapacity - m_capacity;
+	// each arena only ever holds its one array, so these land right after the existing elements
+	[[maybe_unused]] LocalTransform* const locals = m_localArena.AllocArray<LocalTransform>(added);
+	[[maybe_unused]] XMFLOAT4X4A* const worlds = m_worldArena.AllocArray<XMFLOAT4X4A>(added);
+	[[maybe_unused]] XMFLOAT4X4A* const inverses = m_worldInverseTransposeArena.AllocArray<XMFLOAT4X4A>(added);
+	gassert(locals == m_locals + m_capacity);
+	gassert(worlds == m_worldMatrices + m_capacity);
+	gassert(inverses == m_worldInverseTransposeMatrices + m_capacity);
+	m_dirty.Resize(newCapacity);
+	m_inverseTransposeDirty.Resize(newCapacity);
+	m_static.Resize(newCapacity);
+	m_unpublishedBits.Resize(newCapacity);
+	m_changedBits.Resize(newCapacity);
+	m_dirtyRootBits.Resize(newCapacity);
+	m_capacity = newCapacity;
+}
 
-	i32 childIter = trans->childHandle;
+void ggp::TransformHierarchy::InitTransform(u32 index, bool dirty) noexcept
+{
+	EnsureCapacity(index);
+	m_locals[index] = LocalTransform{};
+	XMStoreFloat4x4(&m_worldMatrices[index], XMMatrixIdentity());
+	XMStoreFloat4x4(&m_worldInverseTransposeMatrices[index], XMMatrixIdentity());
+	m_inverseTransposeDirty.Clear(index);
+	m_static.Clear(index);
+	NoteWorldChanged(index);
+	if (dirty)
+		m_dirty.Set(index);
+	else
+		m_dirty.Clear(index);
+}
+
+auto ggp::TransformHierarchy::InsertTransform() noexcept -> Handle
+{
+	auto* ptr = m_linkAllocator.Create<Links>();
+	abort_if(!ptr, "Out of memory for transforms");
+	const u32 index = m_linkAllocator.GetIndexFromPointer(ptr);
+	InitTransform(index, false);
+	LinkRoot(index);
+	m_orderValid = false;
+	return Handle(index);
+}
 
-	// disconnect from sibling (iterate through singly linked list to find previous sibling)
+void ggp::TransformHierarchy::Unlink(Handle handle) noexcept
+{
+	auto* trans = GetLinks(handle);
+	// the first sibling is pointed to by the parent, or by m_firstRoot if there is no parent
+	i32* first = &m_firstRoot;
 	if (!IsNull(trans->parentHandle))
 	{
-		i32 prev = -1;
-		auto* parent = GetPtr(trans->parentHandle);
+		auto* parent = GetLinks(trans->parentHandle);
 		gassert(parent->childCount > 0, "transform with children has child count of 0");
 		parent->childCount--;
-		i32 siblingIter = parent->childHandle;
-		gassert(!IsNull(siblingIter));
-		// handle case that we are the first child
-		if (siblingIter == handle._inner)
-		{
-			parent->childHandle = trans->nextSiblingHandle;
-		}
-		else
-		{
-			// if we are not first child, loop until we get to somebody whose next sibling is us
-			while (true)
-			{
-				auto* current = GetPtr(siblingIter);
-				if (IsNull(current->nextSiblingHandle))
-					break;
-				if (current->nextSiblingHandle == handle._inner)
-				{
-					// we are the next sibling, the current sibling is previous
-					current->nextSiblingHandle = trans->nextSiblingHandle;
-					break;
-				}
-				siblingIter = current->nextSiblingHandle;
-			}
-		}
+		first = &parent->childHandle;
 	}
+	if (IsNull(trans->prevSiblingHandle))
+	{
+		gassert(*first == handle._inner);
+		*first = trans->nextSiblingHandle;
+	}
+	else
+	{
+		GetLinks(trans->prevSiblingHandle)->nextSiblingHandle = trans->nextSiblingHandle;
+	}
+	if (!IsNull(trans->nextSiblingHandle))
+		GetLinks(trans->nextSiblingHandle)->prevSiblingHandle = trans->prevSiblingHandle;
+	trans->parentHandle = -1;
+	trans->prevSiblingHandle = -1;
+	trans->nextSiblingHandle = -1;
+	m_orderValid = false;
+}
+
+void ggp::TransformHierarchy::LinkRoot(u32 transform) noexcept
+{
+	auto* trans = GetLinks(transform);
+	gassert(IsNull(trans->parentHandle));
+	trans->prevSiblingHandle = -1;
+	trans->nextSiblingHandle = m_firstRoot;
+	if (!IsNull(m_firstRoot))
+		GetLinks(m_firstRoot)->prevSiblingHandle = i32(transform);
+	m_firstRoot = i32(transform);
+	m_orderValid = false;
+}
+
+void ggp::TransformHierarchy::Destroy(Handle handle) noexcept
+{
+	abort_if(IsNull(handle), "Attempt to destroy null transform");
+	auto* trans = GetLinks(handle);
+
+	i32 childIter = trans->childHandle;
+	// the orphans' world transforms are built on ours, so work it out while we still have a parent
+	if (IsDirty(handle))
+		Clean(handle._inner);
+	Unlink(handle);
 
 	// just to be sure nothing else tries to traverse to children
 	trans->childHandle = -1;
+	// the index may be reused by the next transform, which UpdateAll should not visit on our behalf
+	m_dirtyRootBits.Clear(u32(handle._inner));
+	m_changedBits.Clear(u32(handle._inner));
 
 	// make some orphans
 	// apply parent transform to local transform of children
 	while (!IsNull(childIter))
 	{
-		auto* child = GetPtr(childIter);
+		const Handle childHandle = childIter;
+		auto* child = GetLinks(childHandle);
 		XMVECTOR globalPosition;
 		XMVECTOR globalRotation;
 		XMVECTOR globalScale;
-		LoadMatrixDecomposed(childIter, &globalPosition, &globalRotation, &globalScale);
-		child->parentHandle = -1;
+		LoadMatrixDecomposed(childHandle, &globalPosition, &globalRotation, &globalScale);
 		childIter = child->nextSiblingHandle;
-		// orphan no longer has connection to siblings
-		child->nextSiblingHandle = -1;
-
-		// convert to eulers, requires going in and out of simd registers :(
-		XMFLOAT4 quat;
-		XMStoreFloat4(&quat, globalRotation);
-		XMFLOAT3 eulers = QuatToEuler(quat);
-		globalRotation = XMLoadFloat3(&eulers);
-
-		// restore global position
-		StorePosition(childIter, globalPosition);
-		StoreEulerAngles(childIter, globalRotation);
-		StoreScale(childIter, globalScale);
+		// orphan no longer has connection to siblings, only to the other roots
+		child->parentHandle = -1;
+		LinkRoot(u32(childHandle._inner));
+
+		// without a parent, local space is world space
+		if (IsStatic(childHandle))
+		{
+			// the baked world matrix is already right, and a static subtree has nothing dirty to propagate
+			LocalTransform& local = GetLocal(childHandle);
+			XMStoreFloat3(&local.position, globalPosition);
+			XMStoreFloat4(&local.rotation, XMQuaternionNormalize(globalRotation));
+			XMStoreFloat3(&local.scale, globalScale);
+			continue;
+		}
+		StoreLocalPosition(childHandle, globalPosition);
+		StoreLocalRotationQuat(childHandle, globalRotation);
+		StoreLocalScale(childHandle, globalScale);
+	}
+
+	m_linkAllocator.Destroy(trans);
+}
+
+void ggp::TransformHierarchy::DestroySubtree(Handle handle) noexcept
+{
+	abort_if(IsNull(handle), "Attempt to destroy null transform");
+
+	Unlink(handle);
+
+	// free the subtree from the bottom up without a stack: go down to a leaf, free it, and carry on from
+	// its next sibling, or from its parent once that has no children left
+	u32 current = u32(handle._inner);
+	while (true)
+	{
+		for (i32 child = GetLinks(current)->childHandle; !IsNull(child); child = GetLinks(child)->childHandle)
+			current = u32(child);
+
+		auto* leaf = GetLinks(current);
+		const i32 parent = leaf->parentHandle;
+		const i32 next = leaf->nextSiblingHandle;
+		m_linkAllocator.Destroy(leaf);
+		// the index may be reused by the next transform, which UpdateAll should not visit on our behalf.
+		// the dirty root list can be thousands long right after a load, so it is left to UpdateAll to
+		// drop the entry
+		m_dirtyRootBits.Clear(current);
+		m_changedBits.Clear(current);
+		if (current == u32(handle._inner))
+			break;
+
+		// the freed leaf was always its parent's first child
+		GetLinks(parent)->childHandle = next;
+		if (!IsNull(next))
+			GetLinks(next)->prevSiblingHandle = -1;
+		current = u32(IsNull(next) ? parent : next);
 	}
+}
 
-	m_transformAllocator.Destroy(trans);
+void ggp::TransformHierarchy::MarkStatic(Handle handle) noexcept
+{
+	abort_if(IsNull(handle), "Attempt to mark null transform static");
+
+	// walk the subtree parents first without a stack, so that cleaning each transform only has to go
+	// one step up. Clean uses the scratch arena, so this cannot keep its own stack there
+	const u32 root = u32(handle._inner);
+	u32 current = root;
+	while (true)
+	{
+		if (IsDirty(current))
+			Clean(current);
+		m_static.Set(current);
+
+		const Links* links = GetLinks(current);
+		if (!IsNull(links->childHandle))
+		{
+			current = u32(links->childHandle);
+			continue;
+		}
+		// go back up until there is a next sibling, without leaving the subtree
+		while (current != root && IsNull(GetLinks(current)->nextSiblingHandle))
+			current = u32(GetLinks(current)->parentHandle);
+		if (current == root)
+			break;
+		current = u32(GetLinks(current)->nextSiblingHandle);
+	}
 }
 
+void ggp::TransformHierarchy::BakeStaticChild(u32 transform) noexcept
+{
+	const u32 parent = u32(GetLinks(transform)->parentHandle);
+	gassert(IsStatic(parent) && !IsDirty(parent));
+	CleanFromParent(transform, XMLoadFloat4x4(&GetWorld(parent)));
+	m_static.Set(transform);
+}
+
+auto ggp::TransformHierarchy::Compact() noexcept -> BlockAllocator::RelocationTable
+{
+	gassert(m_scratch.BytesUsed() == 0);
+	// the published buffers are indexed by the old handles, so rather than tracking which slots each one
+	// is missing after the move, the next two publishes just copy everything
+	for (const u32 transform : m_unpublished)
+		m_unpublishedBits.Clear(transform);
+	m_unpublished.clear();
+	m_lastPublished.clear();
+	m_fullPublishes = u32(m_published.size());
+
+	BlockAllocator::RelocationTable table = m_linkAllocator.Compact();
+
+	// destroyed transforms still in the list of changes have no new index, everything else follows its block
+	std::erase_if(m_changes, [&table](Handle h) {
+		return u32(h._inner) < table.newIndices.size() && table.newIndices[h._inner] == UINT32_MAX;
+	});
+	for (Handle& h : m_changes)
+		h = RelocateHandle(h, table);
+	m_consumedChanges.clear();
+	// destroyed dirty roots are the only ones without their bit set, and have no new index either
+	std::erase_if(m_dirtyRoots, [this](u32 root) { return !m_dirtyRootBits.Test(root); });
+
+	// the links were memcpy'd, everything else has to be moved along with them. blocks only ever
+	// move down into slots that were free, so nothing is overwritten before it is moved
+	for (u32 oldIndex = 0; oldIndex < table.newIndices.size(); ++oldIndex)
+	{
+		const u32 newIndex = table.newIndices[oldIndex];
+		if (newIndex == UINT32_MAX || newIndex == oldIndex)
+			continue;
+		m_locals[newIndex] = m_locals[oldIndex];
+		m_worldMatrices[newIndex] = m_worldMatrices[oldIndex];
+		m_worldInverseTransposeMatrices[newIndex] = m_worldInverseTransposeMatrices[oldIndex];
+		if (m_dirty.Test(oldIndex))
+			m_dirty.Set(newIndex);
+		else
+			m_dirty.Clear(newIndex);
+		if (m_inverseTransposeDirty.Test(oldIndex))
+			m_inverseTransposeDirty.Set(newIndex);
+		else
+			m_inverseTransposeDirty.Clear(newIndex);
+		if (m_static.Test(oldIndex))
+			m_static.Set(newIndex);
+		else
+			m_static.Clear(newIndex);
+		// unlike the bits above, InitTransform does not overwrite this one when the old slot is reused.
+		// moved blocks always come from past the end of the live ones, so nothing moves into oldIndex
+		if (m_changedBits.Test(oldIndex))
+			m_changedBits.Set(newIndex);
+		else
+			m_changedBits.Clear(newIndex);
+		m_changedBits.Clear(oldIndex);
+		// same for this one
+		if (m_dirtyRootBits.Test(oldIndex))
+			m_dirtyRootBits.Set(newIndex);
+		else
+			m_dirtyRootBits.Clear(newIndex);
+		m_dirtyRootBits.Clear(oldIndex);
+	}
+
+	// the links still point at old indices
+	const auto relocate = [&table](i32& link) {
+		if (link >= 0)
+			link = i32(table.Relocate(u32(link)));
+	};
+	for (u32 i = 0; i < table.liveBlocks; ++i)
+	{
+		Links* const trans = GetLinks(i);
+		relocate(trans->parentHandle);
+		relocate(trans->prevSiblingHandle);
+		relocate(trans->nextSiblingHandle);
+		relocate(trans->childHandle);
+	}
+	for (u32& root : m_dirtyRoots)
+		root = table.Relocate(root);
+	relocate(m_firstRoot);
+	m_orderValid = false;
+	return table;
+}
+
+auto ggp::TransformHierarchy::RelocateHandle(Handle h, const BlockAllocator::RelocationTable& table) noexcept -> Handle
+{
+	gassert(h._inner >= 0, "attempt to relocate null transform");
+	return Handle(table.Relocate(u32(h._inner)));
+}
 
 auto ggp::TransformHierarchy::GetFirstChild(Handle h) const noexcept -> std::optional<Handle>
 {
 	abort_if(IsNull(h), "Attempt to get child of null transform");
-	auto* trans = GetPtr(h);
+	auto* trans = GetLinks(h);
 	return IsNull(trans->childHandle) ? std::optional<Handle>{} : Handle(trans->childHandle);
 }
 
 auto ggp::TransformHierarchy::GetNextSibling(Handle h) const noexcept -> std::optional<Handle>
 {
 	abort_if(IsNull(h), "Attempt to get sibling of null transform");
-	auto* trans = GetPtr(h);
+	auto* trans = GetLinks(h);
+	// roots are linked together too, but they are not siblings
+	if (IsNull(trans->parentHandle))
+		return {};
 	return IsNull(trans->nextSiblingHandle) ? std::optional<Handle>{} : Handle(trans->nextSiblingHandle);
 }
 
 auto ggp::TransformHierarchy::GetParent(Handle h) const noexcept -> std::optional<Handle>
 {
 	abort_if(IsNull(h), "Attempt to get parent of null transform");
-	auto* trans = GetPtr(h);
+	auto* trans = GetLinks(h);
 	return IsNull(trans->parentHandle) ? std::optional<Handle>{} : Handle(trans->parentHandle);
 }
 
 u32 ggp::TransformHierarchy::GetChildCount(Handle h) const noexcept
 {
 	abort_if(IsNull(h), "Attempt to get child count of null transform");
-	return GetPtr(h)->childCount;
+	return GetLinks(h)->childCount;
 }
 
 auto ggp::TransformHierarchy::AddChild(Handle h) noexcept -> Handle
 {
 	abort_if(IsNull(h), "Attempt to add child to null transform");
-	auto* trans = GetPtr(h);
+	auto* trans = GetLinks(h);
 
-	auto* newChild = m_transformAllocator.Create<InternalTransform>();
-	u32 newChildIndex = m_transformAllocator.GetIndexFromPointer(newChild);
+	auto* newChild = m_linkAllocator.Create<Links>();
+	abort_if(!newChild, "Out of memory for transforms");
+	u32 newChildIndex = m_linkAllocator.GetIndexFromPointer(newChild);
 	newChild->parentHandle = h._inner;
+	InitTransform(newChildIndex, true); // needs to be calculated from parent, unlike InsertTransform
+	if (IsStatic(h))
+		BakeStaticChild(newChildIndex);
+	else
+		PushDirtyRoot(newChildIndex);
 
 	if (!IsNull(trans->childHandle))
 	{
 		// transform already has a child, insert into linked list
-		auto* existingChild = GetPtr(trans->childHandle);
-
-		newChild->nextSiblingHandle = m_transformAllocator.GetIndexFromPointer(existingChild);
-		newChild->isDirty = true; // needs to be calculated from parent, unlike InsertTransform
+		newChild->nextSiblingHandle = trans->childHandle;
+		GetLinks(trans->childHandle)->prevSiblingHandle = i32(newChildIndex);
 	}
 
 	trans->childHandle = newChildIndex;
 	trans->childCount++;
+	m_orderValid = false;
 	return Handle(newChildIndex);
 }
 
+void ggp::TransformHierarchy::AddChildren(Handle h, u32 count, std::vector<Handle>& out) noexcept
+{
+	abort_if(IsNull(h), "Attempt to add children to null transform");
+	if (count == 0)
+		return;
+
+	std::vector<Links*> children(count);
+	abort_if(!m_linkAllocator.CreateN<Links>(children), "Out of memory for transforms");
+
+	// link all the new children to each other in one pass, then splice them in front of any
+	// existing children
+	auto* trans = GetLinks(h);
+	i32 next = trans->childHandle;
+	for (u32 i = count; i-- > 0;)
+	{
+		Links* const child = children[i];
+		const i32 index = i32(m_linkAllocator.GetIndexFromPointer(child));
+		child->parentHandle = h._inner;
+		child->nextSiblingHandle = next;
+		if (!IsNull(next))
+			GetLinks(next)->prevSiblingHandle = index;
+		next = index;
+		InitTransform(u32(next), true); // needs to be calculated from parent
+		if (IsStatic(h))
+			BakeStaticChild(u32(next));
+		else
+			PushDirtyRoot(u32(next));
+	}
+	trans->childHandle = next;
+	trans->childCount += count;
+	m_orderValid = false;
+
+	out.reserve(out.size() + count);
+	for (Links* child : children)
+		out.push_back(Handle(m_linkAllocator.GetIndexFromPointer(child)));
+}
+
 void ggp::TransformHierarchy::Clean(u32 transform) const noexcept
 {
-	gassert(m_cleaningArena.empty(), "recursive call to Clean()?");
+	gassert(m_scratch.BytesUsed() == 0, "recursive call to Clean()?");
 
+	// push every dirty ancestor into the scratch arena, consecutive pushes end up as one array.
+	// marking a transform dirty also marks its whole subtree, so once a clean ancestor is found
+	// everything above it is clean too and its world matrix can be used as is
+	u32* chain = nullptr;
+	u32 depth = 0;
 	u32 iter = transform;
 	while (!IsNull(iter))
 	{
-		m_cleaningArena.push_back(iter);
+		if (!IsDirty(iter))
+			break;
 
-		InternalTransform* iterPtr = GetPtr(iter);
-		//if (!iterPtr->isDirty) [[unlikely]]
-		//	break;
-		iter = u32(iterPtr->parentHandle);
-	}
+		u32* const slot = m_scratch.Create<u32>(iter);
+		abort_if(!slot, "transform hierarchy scratch space exhausted");
+		if (!chain)
+			chain = slot;
+		gassert(slot == chain + depth);
+		++depth;
 
-	// weve built a stack of transforms, now multiply them downwards (like down a family tree)
-	XMMATRIX mat = XMMatrixIdentity();
-	//for (const auto& i : m_cleaningArena | std::views::reverse)
-	for (auto i = m_cleaningArena.rbegin(); i != m_cleaningArena.rend(); ++i)
-	{
-		InternalTransform* const ptr = GetPtr(*i);
-
-		const XMVECTOR localPosition = XMLoadFloat3(&ptr->localPosition);
-		const XMVECTOR localRotation = XMQuaternionRotationRollPitchYawFromVector(XMLoadFloat3(&ptr->localRotation));
-		const XMVECTOR localScale = XMLoadFloat3(&ptr->localScale);
-		gassert(!XMVector3IsNaN(localPosition));
-		gassert(!XMVector3IsNaN(localRotation));
-		gassert(!XMVector3IsNaN(localScale));
-		
-		const XMMATRIX localTransform = XMMatrixAffineTransformation(
-			localScale,
-			g_XMZero.v,
-			localRotation,
-			localPosition);
-		gassert(!XMMatrixIsNaN(localTransform));
-	
-		mat = XMMatrixMultiply(localTransform, mat);
-		gassert(!XMMatrixIsNaN(mat));
-
-		// store the calculated global matrix for this object
-		XMStoreFloat4x4(&ptr->worldMatrix, mat);
-		XMStoreFloat4x4(&ptr->worldInverseTransposeMatrix, XMMatrixInverse(0, XMMatrixTranspose(mat)));
-		ptr->isDirty = false;
+		iter = u32(GetLinks(iter)->parentHandle);
 	}
-	gassert(!GetPtr(transform)->isDirty);
-	m_cleaningArena.clear();
+	gassert(depth > 0, "Clean() called on a transform which is not dirty");
+
+	// weve built a stack of transforms, now multiply them downwards (like down a family tree),
+	// starting from the clean ancestor if there is one
+	XMMATRIX mat = IsNull(iter) ? XMMatrixIdentity() : XMLoadFloat4x4(&GetWorld(iter));
+	for (u32 i = depth; i-- > 0;)
+		mat = CleanFromParent(chain[i], mat);
+	gassert(!IsDirty(transform));
+	m_scratch.Reset();
+}
+
+XMMATRIX TH_VECTORCALL ggp::TransformHierarchy::CleanFromParent(u32 transform, FXMMATRIX parentWorld) const noexcept
+{
+	const XMMATRIX mat = ComposeWorldMatrix(m_locals[transform], parentWorld);
+
+	// store the calculated global matrix for this object
+	XMStoreFloat4x4(&m_worldMatrices[transform], mat);
+	m_dirty.Clear(transform);
+	m_inverseTransposeDirty.Set(transform);
+	NoteWorldChanged(transform);
+	return mat;
 }
 
 void ggp::TransformHierarchy::MarkDirty(u32 transform) const noexcept
 {
-	m_dirtyStack.clear();
-	DirtyStackFrame frame{ .transform = i32(transform) };
+	gassert(!IsStatic(transform), "attempt to modify a static transform");
+	if (IsDirty(transform) || IsStatic(transform))
+		return;
+	PushDirtyRoot(transform);
+
+	gassert(m_scratch.BytesUsed() == 0);
+	// zero sized allocation just to get an aligned base for the stack
+	u32* const stack = m_scratch.AllocArray<u32>(0);
+	size_t stackSize = 0;
+
+	// using the arena instead of the call stack like we would in a recursive solution. only the
+	// transform's own children are followed, not its siblings
+	m_dirty.Set(transform);
+	u32 current = transform;
 	while (true)
 	{
-		// using this vector instead of the call stack like we would in a recursive solution
-		InternalTransform* current = GetPtr(frame.transform);
-		// depth first
-		if (!frame.triedChild && !IsNull(current->childHandle))
+		for (i32 child = GetLinks(current)->childHandle; !IsNull(child); child = GetLinks(child)->nextSiblingHandle)
 		{
-			frame.triedChild = true;
-			m_dirtyStack.push_back(frame);
-			frame = DirtyStackFrame{ .transform = current->childHandle };
-			continue; // recurse
+			// an already dirty child has an entirely dirty subtree, and a static one is never updated
+			if (IsDirty(child) || IsStatic(child))
+				continue;
+			m_dirty.Set(child);
+			abort_if(!m_scratch.Create<u32>(u32(child)), "transform hierarchy scratch space exhausted");
+			++stackSize;
 		}
-		else if (!frame.triedSibling && !IsNull(current->nextSiblingHandle))
+
+		if (stackSize == 0)
+			break;
+		--stackSize;
+		current = stack[stackSize];
+		m_scratch.ResetToMarker(m_scratch.GetMarker() - sizeof(u32));
+	}
+	m_scratch.Reset();
+}
+
+void ggp::TransformHierarchy::UpdateAll(WorkerPool* pool) noexcept
+{
+	// drop the entries for destroyed transforms, and any repeats left after their index was reused
+	std::erase_if(m_dirtyRoots, [this](u32 root) {
+		if (!m_dirtyRootBits.Test(root))
+			return true;
+		m_dirtyRootBits.Clear(root);
+		return false;
+	});
+	if (m_dirtyRoots.empty())
+		return;
+	if (!m_orderValid)
+		RebuildOrder();
+
+	// swap each dirty root for its position in the order. sorted, an ancestor comes before all of
+	// its descendants, so a root inside of the previous root's range has already been swept
+	for (u32& root : m_dirtyRoots)
+		root = m_orderIndex[root];
+	std::sort(m_dirtyRoots.begin(), m_dirtyRoots.end());
+
+	// collect every dirty transform under the dirty roots, counting how many there are at each depth
+	m_dirtyPositions.clear();
+	m_levelEnds.assign(size_t(m_maxDepth) + 1, 0);
+	u32 sweptEnd = 0;
+	for (const u32 begin : m_dirtyRoots)
+	{
+		if (begin < sweptEnd)
+			continue;
+		const u32 end = begin + m_subtreeSizes[begin];
+		for (u32 i = begin; i < end; ++i)
 		{
-			frame.triedSibling = true;
-			m_dirtyStack.push_back(frame);
-			frame = DirtyStackFrame{ .transform = current->nextSiblingHandle };
-			continue; // recurse
+			// static subtrees are whole, and never dirty
+			if (IsStatic(m_order[i]))
+			{
+				i += m_subtreeSizes[i] - 1;
+				continue;
+			}
+			// a clean transform can still have dirty children, so this cannot skip ahead
+			if (!IsDirty(m_order[i]))
+				continue;
+			m_dirtyPositions.push_back(i);
+			++m_levelEnds[m_depths[i]];
 		}
+		sweptEnd = end;
+	}
+	m_dirtyRoots.clear();
+
+	// counting sort them by depth. a transform only depends on its parent, which is one level up, so
+	// once a level is done the whole next one can be computed side by side
+	u32 levelStart = 0;
+	for (u32& level : m_levelEnds)
+		levelStart += std::exchange(level, levelStart);
+	m_batchTransforms.resize(m_dirtyPositions.size());
+	m_batchParents.resize(m_dirtyPositions.size());
+	for (const u32 position : m_dirtyPositions)
+	{
+		const u32 slot = m_levelEnds[m_depths[position]]++;
+		const u32 transform = m_order[position];
+		m_batchTransforms[slot] = transform;
+		m_batchParents[slot] = GetLinks(transform)->parentHandle;
+		// nothing reads the dirty bits until the levels below are done
+		m_dirty.Clear(transform);
+		m_inverseTransposeDirty.Set(transform);
+		NoteWorldChanged(transform);
+	}
 
-		// okay, no children and no next siblings. mark dirty
-		current->isDirty = true;
-		if (m_dirtyStack.empty())
-			break;
-		frame = m_dirtyStack.back();
-		m_dirtyStack.pop_back();
+	// each entry has been bumped up to the end of its level
+	u32 levelBegin = 0;
+	for (const u32 levelEnd : m_levelEnds)
+	{
+		const u32 chunks = (levelEnd - levelBegin + parallelChunkSize - 1) / parallelChunkSize;
+		if (pool && chunks > 1)
+		{
+			// chunks start at fixed offsets into the level, so the result does not depend on how
+			// many threads there are or which one gets which chunk
+			pool->ParallelFor(chunks, [this, levelBegin, levelEnd](u32 chunk) {
+				const u32 begin = levelBegin + (chunk * parallelChunkSize);
+				ComposeRange(begin, (std::min)(begin + parallelChunkSize, levelEnd));
+			});
+		}
+		else if (levelEnd > levelBegin)
+		{
+			ComposeRange(levelBegin, levelEnd);
+		}
+		levelBegin = levelEnd;
 	}
-	m_dirtyStack.clear();
 }
 
-const DirectX::XMFLOAT4X4* ggp::TransformHierarchy::GetWorldMatrixPtr(Handle h) const noexcept
+void ggp::TransformHierarchy::ComposeRange(u32 begin, u32 end) const noexcept
 {
-	auto* trans = GetPtr(h);
-	if (trans->isDirty) {
-		Clean(h._inner);
+	m_composeWorldMatrices(ComposeBatch{
+		.transforms = m_batchTransforms.data() + begin,
+		.parents = m_batchParents.data() + begin,
+		.count = end - begin,
+		.locals = m_locals,
+		.worldMatrices = m_worldMatrices,
+	});
+}
+
+void ggp::TransformHierarchy::RebuildOrder() noexcept
+{
+	m_order.clear();
+
+	gassert(m_scratch.BytesUsed() == 0);
+	// zero sized allocation just to get an aligned base for the stack
+	u32* const stack = m_scratch.AllocArray<u32>(0);
+	for (i32 root = m_firstRoot; !IsNull(root); root = GetLinks(root)->nextSiblingHandle)
+	{
+		abort_if(!m_scratch.Create<u32>(root), "transform hierarchy scratch space exhausted");
+		size_t stackSize = 1;
+		// everything pushed while visiting a transform is popped before anything under it, so its
+		// whole subtree ends up right after it
+		while (stackSize > 0)
+		{
+			--stackSize;
+			const u32 current = stack[stackSize];
+			m_scratch.ResetToMarker(m_scratch.GetMarker() - sizeof(u32));
+
+			if (current >= m_orderIndex.size())
+				m_orderIndex.resize(current + 1);
+			m_orderIndex[current] = u32(m_order.size());
+			m_order.push_back(current);
+
+			for (i32 child = GetLinks(current)->childHandle; !IsNull(child); child = GetLinks(child)->nextSiblingHandle)
+			{
+				abort_if(!m_scratch.Create<u32>(u32(child)), "transform hierarchy scratch space exhausted");
+				++stackSize;
+			}
+		}
+	}
+	m_scratch.Reset();
+
+	// children come after their parents, so going backwards every subtree is finished before it is
+	// added to its parent
+	m_subtreeSizes.assign(m_order.size(), 1);
+	for (size_t i = m_order.size(); i-- > 0;)
+	{
+		const i32 parent = GetLinks(m_order[i])->parentHandle;
+		if (!IsNull(parent))
+			m_subtreeSizes[m_orderIndex[parent]] += m_subtreeSizes[i];
+	}
+
+	// and going forwards every parent's depth is known before its children's
+	m_depths.resize(m_order.size());
+	m_maxDepth = 0;
+	for (size_t i = 0; i < m_order.size(); ++i)
+	{
+		const i32 parent = GetLinks(m_order[i])->parentHandle;
+		m_depths[i] = IsNull(parent) ? 0 : m_depths[m_orderIndex[parent]] + 1;
+		m_maxDepth = (std::max)(m_maxDepth, m_depths[i]);
 	}
-	gassert(!trans->isDirty);
-	return &trans->worldMatrix;
+	m_orderValid = true;
 }
 
-const DirectX::XMFLOAT4X4* ggp::TransformHierarchy::GetWorldInverseTransposeMatrixPtr(Handle h) const noexcept
+void ggp::TransformHierarchy::PublishFrame() noexcept
 {
-	auto* trans = GetPtr(h);
-	if (trans->isDirty) {
+	gassert(!HasDirtyRoots(), "PublishFrame() called with transforms modified since UpdateAll()");
+
+	const u32 back = m_frontBuffer.load(std::memory_order_relaxed) ^ 1;
+	PublishedBuffer& buffer = m_published[back];
+	if (buffer.capacity < m_capacity)
+	{
+		const u32 added = m_capacity - buffer.capacity;
+		[[maybe_unused]] XMFLOAT4X4A* const worlds = buffer.worldArena.AllocArray<XMFLOAT4X4A>(added);
+		[[maybe_unused]] XMFLOAT4X4A* const inverses = buffer.worldInverseTransposeArena.AllocArray<XMFLOAT4X4A>(added);
+		gassert(worlds == buffer.worldMatrices + buffer.capacity);
+		gassert(inverses == buffer.worldInverseTransposeMatrices + buffer.capacity);
+		buffer.inverseTransposeDirty.Resize(m_capacity);
+		buffer.capacity = m_capacity;
+	}
+
+	// inverse transposes are still only computed when something asks for them. one that has been
+	// already is copied, otherwise the reader of the published frame works it out
+	const auto publish = [this, &buffer](u32 transform) {
+		buffer.worldMatrices[transform] = m_worldMatrices[transform];
+		if (m_inverseTransposeDirty.Test(transform))
+		{
+			buffer.inverseTransposeDirty.Set(transform);
+		}
+		else
+		{
+			buffer.worldInverseTransposeMatrices[transform] = m_worldInverseTransposeMatrices[transform];
+			buffer.inverseTransposeDirty.Clear(transform);
+		}
+	};
+	if (m_fullPublishes > 0)
+	{
+		--m_fullPublishes;
+		if (!m_orderValid)
+			RebuildOrder();
+		for (const u32 transform : m_order)
+			publish(transform);
+	}
+	else
+	{
+		// the back buffer was last written two frames ago, so it is missing last frame's changes as
+		// well as this one's. a transform in both lists is just copied twice
+		for (const u32 transform : m_lastPublished)
+			publish(transform);
+		for (const u32 transform : m_unpublished)
+			publish(transform);
+	}
+
+	for (const u32 transform : m_unpublished)
+		m_unpublishedBits.Clear(transform);
+	std::swap(m_lastPublished, m_unpublished);
+	m_unpublished.clear();
+
+	buffer.frameNumber = ++m_publishedFrames;
+	// everything written above is visible to a reader which sees the new index
+	m_frontBuffer.store(back, std::memory_order_release);
+}
+
+auto ggp::TransformHierarchy::GetPublishedFrame() const noexcept -> PublishedFrame
+{
+	PublishedBuffer& buffer = m_published[m_frontBuffer.load(std::memory_order_acquire)];
+	PublishedFrame frame;
+	frame.m_worldMatrices = buffer.worldMatrices;
+	frame.m_worldInverseTransposeMatrices = buffer.worldInverseTransposeMatrices;
+	frame.m_inverseTransposeDirty = &buffer.inverseTransposeDirty;
+	frame.m_count = buffer.capacity;
+	frame.m_frameNumber = buffer.frameNumber;
+	return frame;
+}
+
+auto ggp::TransformHierarchy::ConsumeChanges() noexcept -> std::span<const Handle>
+{
+	gassert(!HasDirtyRoots(), "ConsumeChanges() called with transforms modified since UpdateAll()");
+	std::swap(m_changes, m_consumedChanges);
+	m_changes.clear();
+
+	// a destroyed transform's bit was cleared, and so is a repeat's by the time it is reached: the index
+	// was freed and then reused, so the transform was listed again as new
+	std::erase_if(m_consumedChanges, [this](Handle h) {
+		if (!m_changedBits.Test(size_t(h._inner)))
+			return true;
+		m_changedBits.Clear(size_t(h._inner));
+		return false;
+	});
+	return m_consumedChanges;
+}
+
+const DirectX::XMFLOAT4X4* ggp::TransformHierarchy::GetWorldMatrixPtr(Handle h) const noexcept
+{
+	if (IsDirty(h)) {
 		Clean(h._inner);
 	}
-	gassert(!trans->isDirty);
-	return &trans->worldInverseTransposeMatrix;
+	gassert(!IsDirty(h));
+	return &GetWorld(h);
 }
 
-ggp::TransformHierarchy::InternalTransform::InternalTransform() noexcept
+const DirectX::XMFLOAT4X4* ggp::TransformHierarchy::GetWorldInverseTransposeMatrixPtr(Handle h) const noexcept
 {
-	// the NSDMIs handle most stuff, except the matrices
-	XMStoreFloat4x4(&worldMatrix, XMMatrixIdentity());
-	XMStoreFloat4x4(&worldInverseTransposeMatrix, XMMatrixIdentity());
+	if (IsDirty(h)) {
+		Clean(h._inner);
+	}
+	gassert(!IsDirty(h));
+	return &GetWorldInverseTranspose(h);
 }
 
 DirectX::XMFLOAT3 ggp::TransformHierarchy::GetLocalPosition(Handle h) const
 {
-	return GetPtr(h)->localPosition;
+	return GetLocal(h).position;
 }
 
 DirectX::XMFLOAT3  ggp::TransformHierarchy::GetLocalEulerAngles(Handle h) const
 {
-	return GetPtr(h)->localRotation;
+	return QuatToEuler(GetLocal(h).rotation);
 }
 
 DirectX::XMFLOAT3  ggp::TransformHierarchy::GetLocalScale(Handle h) const
 {
-	return GetPtr(h)->localScale;
+	return GetLocal(h).scale;
 }
 
 void  ggp::TransformHierarchy::SetLocalPosition(Handle h, DirectX::XMFLOAT3 position)
@@ -270,7 +800,7 @@ void  ggp::TransformHierarchy::SetLocalPosition(Handle h, DirectX::XMFLOAT3 posi
 	using namespace DirectX;
 	gassert(!XMVector3IsNaN(XMLoadFloat3(&position)));
 	gassert(!XMVector3IsInfinite(XMLoadFloat3(&position)));
-	GetPtr(h)->localPosition = position;
+	GetLocal(h).position = position;
 	MarkDirty(h._inner);
 }
 
@@ -279,7 +809,7 @@ void  ggp::TransformHierarchy::SetLocalEulerAngles(Handle h, DirectX::XMFLOAT3 r
 	using namespace DirectX;
 	gassert(!XMVector3IsNaN(XMLoadFloat3(&rotation)));
 	gassert(!XMVector3IsInfinite(XMLoadFloat3(&rotation)));
-	GetPtr(h)->localRotation = rotation;
+	XMStoreFloat4(&GetLocal(h).rotation, XMQuaternionRotationRollPitchYaw(rotation.x, rotation.y, rotation.z));
 	MarkDirty(h._inner);
 }
 
@@ -288,7 +818,7 @@ void  ggp::TransformHierarchy::SetLocalScale(Handle h, DirectX::XMFLOAT3 scale)
 	using namespace DirectX;
 	gassert(!XMVector3IsNaN(XMLoadFloat3(&scale)));
 	gassert(!XMVector3IsInfinite(XMLoadFloat3(&scale)));
-	GetPtr(h)->localScale = scale;
+	GetLocal(h).scale = scale;
 	MarkDirty(h._inner);
 }
 
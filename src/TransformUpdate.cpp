@@ -0,0 +1,245 @@
+#include "TransformUpdate.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define GGP_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+#else
+#define GGP_X86 0
+#endif
+
+using namespace DirectX;
+
+namespace
+{
+	// one row or column of a 3x3 matrix, for four transforms at once. each vector holds the same
+	// component of all four
+	struct Lanes3
+	{
+		XMVECTOR x;
+		XMVECTOR y;
+		XMVECTOR z;
+	};
+
+	inline Lanes3 XM_CALLCONV TransposeToLanes(FXMVECTOR a, FXMVECTOR b, FXMVECTOR c, CXMVECTOR d) noexcept
+	{
+		const XMMATRIX lanes = XMMatrixTranspose(XMMATRIX(a, b, c, d));
+		return Lanes3{ lanes.r[0], lanes.r[1], lanes.r[2] };
+	}
+
+	inline Lanes3 XM_CALLCONV Scale(const Lanes3& a, FXMVECTOR s) noexcept
+	{
+		return Lanes3{ XMVectorMultiply(a.x, s), XMVectorMultiply(a.y, s), XMVectorMultiply(a.z, s) };
+	}
+
+	// row vector times the upper 3x3 of a matrix, plus an optional translation row
+	inline Lanes3 XM_CALLCONV Transform(const Lanes3& v, const Lanes3* matrixRows, const Lanes3& add) noexcept
+	{
+		return Lanes3{
+			XMVectorMultiplyAdd(v.x, matrixRows[0].x, XMVectorMultiplyAdd(v.y, matrixRows[1].x, XMVectorMultiplyAdd(v.z, matrixRows[2].x, add.x))),
+			XMVectorMultiplyAdd(v.x, matrixRows[0].y, XMVectorMultiplyAdd(v.y, matrixRows[1].y, XMVectorMultiplyAdd(v.z, matrixRows[2].y, add.y))),
+			XMVectorMultiplyAdd(v.x, matrixRows[0].z, XMVectorMultiplyAdd(v.y, matrixRows[1].z, XMVectorMultiplyAdd(v.z, matrixRows[2].z, add.z))),
+		};
+	}
+
+	// transpose one row of four matrices back out of lanes and store it into each of them
+	inline void XM_CALLCONV StoreRow(XMFLOAT4X4A* matrices, const u32* transforms, size_t row, const Lanes3& xyz, FXMVECTOR w) noexcept
+	{
+		const XMMATRIX rows = XMMatrixTranspose(XMMATRIX(xyz.x, xyz.y, xyz.z, w));
+		for (size_t lane = 0; lane < 4; ++lane)
+			XMStoreFloat4A(reinterpret_cast<XMFLOAT4A*>(matrices[transforms[lane]].m[row]), rows.r[lane]);
+	}
+}
+
+ggp::SimdLevel ggp::DetectSimdLevel() noexcept
+{
+	static const SimdLevel level = [] {
+#if GGP_X86
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		const bool fma = info[2] & (1 << 12);
+		const bool osxsave = info[2] & (1 << 27);
+		const bool avx = info[2] & (1 << 28);
+		// the OS also has to save the upper halves of the ymm registers on context switches
+		if (!fma || !osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+			return SimdLevel::SSE2;
+		__cpuidex(info, 7, 0);
+		const bool avx2 = info[1] & (1 << 5);
+		return avx2 ? SimdLevel::AVX2 : SimdLevel::SSE2;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? SimdLevel::AVX2 : SimdLevel::SSE2;
+#endif
+#else
+		// DirectXMath's four wide path is NEON here
+		return SimdLevel::SSE2;
+#endif
+	}();
+	return level;
+}
+
+auto ggp::GetComposeWorldMatrices(SimdLevel level) noexcept -> ComposeWorldMatricesFunction
+{
+	switch (level)
+	{
+	case SimdLevel::Scalar:
+		return ComposeWorldMatricesScalar;
+	case SimdLevel::SSE2:
+		return ComposeWorldMatricesSSE2;
+	case SimdLevel::AVX2:
+		return ComposeWorldMatricesAVX2;
+	}
+	gassert(false, "unknown simd level");
+	return ComposeWorldMatricesScalar;
+}
+
+void ggp::ComposeWorldMatricesScalar(const ComposeBatch& batch) noexcept
+{
+	for (size_t i = 0; i < batch.count; ++i)
+	{
+		const u32 transform = batch.transforms[i];
+		const i32 parent = batch.parents[i];
+		const XMMATRIX parentWorld = parent < 0 ? XMMatrixIdentity() : XMLoadFloat4x4A(&batch.worldMatrices[parent]);
+		const XMMATRIX mat = ComposeWorldMatrix(batch.locals[transform], parentWorld);
+		XMStoreFloat4x4A(&batch.worldMatrices[transform], mat);
+	}
+}
+
+void ggp::ComposeWorldMatricesSSE2(const ComposeBatch& batch) noexcept
+{
+	const XMVECTOR zero = XMVectorZero();
+	const XMVECTOR one = XMVectorSplatOne();
+
+	size_t i = 0;
+	for (; i + 4 <= batch.count; i += 4)
+	{
+		const u32* const transforms = batch.transforms + i;
+		const LocalTransform& l0 = batch.locals[transforms[0]];
+		const LocalTransform& l1 = batch.locals[transforms[1]];
+		const LocalTransform& l2 = batch.locals[transforms[2]];
+		const LocalTransform& l3 = batch.locals[transforms[3]];
+
+		const Lanes3 position = TransposeToLanes(XMLoadFloat3(&l0.position), XMLoadFloat3(&l1.position), XMLoadFloat3(&l2.position), XMLoadFloat3(&l3.position));
+		const XMMATRIX rotation = XMMatrixTranspose(XMMATRIX(XMLoadFloat4(&l0.rotation), XMLoadFloat4(&l1.rotation), XMLoadFloat4(&l2.rotation), XMLoadFloat4(&l3.rotation)));
+		const Lanes3 scale = TransposeToLanes(XMLoadFloat3(&l0.scale), XMLoadFloat3(&l1.scale), XMLoadFloat3(&l2.scale), XMLoadFloat3(&l3.scale));
+
+		// XMMatrixRotationQuaternion with each row multiplied by its scale, then the translation
+		const XMVECTOR qx = rotation.r[0];
+		const XMVECTOR qy = rotation.r[1];
+		const XMVECTOR qz = rotation.r[2];
+		const XMVECTOR qw = rotation.r[3];
+		const XMVECTOR x2 = XMVectorAdd(qx, qx);
+		const XMVECTOR y2 = XMVectorAdd(qy, qy);
+		const XMVECTOR z2 = XMVectorAdd(qz, qz);
+		const XMVECTOR xx = XMVectorMultiply(qx, x2);
+		const XMVECTOR yy = XMVectorMultiply(qy, y2);
+		const XMVECTOR zz = XMVectorMultiply(qz, z2);
+		const XMVECTOR xy = XMVectorMultiply(qx, y2);
+		const XMVECTOR xz = XMVectorMultiply(qx, z2);
+		const XMVECTOR yz = XMVectorMultiply(qy, z2);
+		const XMVECTOR wx = XMVectorMultiply(qw, x2);
+		const XMVECTOR wy = XMVectorMultiply(qw, y2);
+		const XMVECTOR wz = XMVectorMultiply(qw, z2);
+		const Lanes3 local[4] = {
+			Scale(Lanes3{
+				XMVectorSubtract(XMVectorSubtract(one, yy), zz),
+				XMVectorAdd(xy, wz),
+				XMVectorSubtract(xz, wy),
+			}, scale.x),
+			Scale(Lanes3{
+				XMVectorSubtract(xy, wz),
+				XMVectorSubtract(XMVectorSubtract(one, xx), zz),
+				XMVectorAdd(yz, wx),
+			}, scale.y),
+			Scale(Lanes3{
+				XMVectorAdd(xz, wy),
+				XMVectorSubtract(yz, wx),
+				XMVectorSubtract(XMVectorSubtract(one, xx), yy),
+			}, scale.z),
+			position,
+		};
+
+		// the parents' world matrices, also in lanes. they are affine so their last column is skipped
+		XMMATRIX parentMatrices[4];
+		for (size_t lane = 0; lane < 4; ++lane)
+		{
+			const i32 parent = batch.parents[i + lane];
+			parentMatrices[lane] = parent < 0 ? XMMatrixIdentity() : XMLoadFloat4x4A(&batch.worldMatrices[parent]);
+		}
+		Lanes3 parentRows[4];
+		for (size_t row = 0; row < 4; ++row)
+			parentRows[row] = TransposeToLanes(parentMatrices[0].r[row], parentMatrices[1].r[row], parentMatrices[2].r[row], parentMatrices[3].r[row]);
+
+		const Lanes3 noTranslation = { zero, zero, zero };
+		const Lanes3 world[4] = {
+			Transform(local[0], parentRows, noTranslation),
+			Transform(local[1], parentRows, noTranslation),
+			Transform(local[2], parentRows, noTranslation),
+			Transform(local[3], parentRows, parentRows[3]),
+		};
+
+		for (size_t row = 0; row < 3; ++row)
+			StoreRow(batch.worldMatrices, transforms, row, world[row], zero);
+		StoreRow(batch.worldMatrices, transforms, 3, world[3], one);
+	}
+
+	if (i < batch.count)
+	{
+		ComposeBatch rest = batch;
+		rest.transforms += i;
+		rest.parents += i;
+		rest.count -= i;
+		ComposeWorldMatricesScalar(rest);
+	}
+}
+
+XMMATRIX XM_CALLCONV ggp::ComputeWorldInverseTranspose(FXMMATRIX world) noexcept
+{
+	// how far the rows may be from orthogonal and equally long, relative to their squared length, to
+	// still count as uniformly scaled
+	constexpr f32 uniformScaleTolerance = 1e-5f;
+
+	const XMVECTOR row0 = world.r[0];
+	const XMVECTOR row1 = world.r[1];
+	const XMVECTOR row2 = world.r[2];
+	const XMVECTOR scaleSquared = XMVector3Dot(row0, row0);
+	const XMVECTOR tolerance = XMVectorMultiply(scaleSquared, XMVectorReplicate(uniformScaleTolerance));
+	const XMVECTOR zero = XMVectorZero();
+	const bool uniform =
+		XMVector3NearEqual(XMVector3Dot(row1, row1), scaleSquared, tolerance) &&
+		XMVector3NearEqual(XMVector3Dot(row2, row2), scaleSquared, tolerance) &&
+		XMVector3NearEqual(XMVector3Dot(row0, row1), zero, tolerance) &&
+		XMVector3NearEqual(XMVector3Dot(row1, row2), zero, tolerance) &&
+		XMVector3NearEqual(XMVector3Dot(row2, row0), zero, tolerance);
+
+	// the inverse transpose of an affine matrix is the inverse transpose of its 3x3 part, and the
+	// translation moves into the last column
+	XMMATRIX inverseTranspose;
+	if (uniform)
+	{
+		// a rotation scaled by s, whose inverse transpose is the rotation over s
+		const XMVECTOR inverseScaleSquared = XMVectorReciprocal(scaleSquared);
+		inverseTranspose.r[0] = XMVectorMultiply(row0, inverseScaleSquared);
+		inverseTranspose.r[1] = XMVectorMultiply(row1, inverseScaleSquared);
+		inverseTranspose.r[2] = XMVectorMultiply(row2, inverseScaleSquared);
+	}
+	else
+	{
+		// the cofactor matrix over the determinant
+		const XMVECTOR cofactor0 = XMVector3Cross(row1, row2);
+		const XMVECTOR inverseDeterminant = XMVectorReciprocal(XMVector3Dot(row0, cofactor0));
+		inverseTranspose.r[0] = XMVectorMultiply(cofactor0, inverseDeterminant);
+		inverseTranspose.r[1] = XMVectorMultiply(XMVector3Cross(row2, row0), inverseDeterminant);
+		inverseTranspose.r[2] = XMVectorMultiply(XMVector3Cross(row0, row1), inverseDeterminant);
+	}
+	for (size_t row = 0; row < 3; ++row)
+	{
+		const XMVECTOR translation = XMVectorNegate(XMVector3Dot(inverseTranspose.r[row], world.r[3]));
+		inverseTranspose.r[row] = XMVectorSelect(translation, inverseTranspose.r[row], g_XMSelect1110);
+	}
+	inverseTranspose.r[3] = g_XMIdentityR3;
+	return inverseTranspose;
+}
\ No newline at end of file
@@ -0,0 +1,167 @@
+#include "TransformUpdate.h"
+
+// this file is built with AVX2 and FMA enabled (/arch:AVX2 or -mavx2 -mfma), so nothing in it may run
+// unless DetectSimdLevel() found them. that includes inline functions from headers, which the linker
+// could pick this file's copy of for every other caller, so only plain intrinsics are used in here
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cstddef>
+
+namespace
+{
+	// same as the Lanes3 of the four wide version, for eight transforms at once
+	struct Lanes3
+	{
+		__m256 x;
+		__m256 y;
+		__m256 z;
+	};
+
+	inline __m256 Splat(f32 f) noexcept { return _mm256_set1_ps(f); }
+
+	inline Lanes3 Scale(const Lanes3& a, __m256 s) noexcept
+	{
+		return Lanes3{ _mm256_mul_ps(a.x, s), _mm256_mul_ps(a.y, s), _mm256_mul_ps(a.z, s) };
+	}
+
+	// row vector times the upper 3x3 of a matrix, plus an optional translation row
+	inline Lanes3 Transform(const Lanes3& v, const Lanes3* matrixRows, const Lanes3& add) noexcept
+	{
+		return Lanes3{
+			_mm256_fmadd_ps(v.x, matrixRows[0].x, _mm256_fmadd_ps(v.y, matrixRows[1].x, _mm256_fmadd_ps(v.z, matrixRows[2].x, add.x))),
+			_mm256_fmadd_ps(v.x, matrixRows[0].y, _mm256_fmadd_ps(v.y, matrixRows[1].y, _mm256_fmadd_ps(v.z, matrixRows[2].y, add.y))),
+			_mm256_fmadd_ps(v.x, matrixRows[0].z, _mm256_fmadd_ps(v.y, matrixRows[1].z, _mm256_fmadd_ps(v.z, matrixRows[2].z, add.z))),
+		};
+	}
+
+	// load the first three floats of a member of eight local transforms into lanes
+	inline Lanes3 GatherLocal(const ggp::LocalTransform* locals, __m256i offsets, size_t memberOffset) noexcept
+	{
+		const f32* const base = reinterpret_cast<const f32*>(reinterpret_cast<const u8*>(locals) + memberOffset);
+		return Lanes3{
+			_mm256_i32gather_ps(base, offsets, sizeof(f32)),
+			_mm256_i32gather_ps(base + 1, offsets, sizeof(f32)),
+			_mm256_i32gather_ps(base + 2, offsets, sizeof(f32)),
+		};
+	}
+
+	// transpose one row of eight matrices back out of lanes and store it into each of them
+	inline void StoreRow(DirectX::XMFLOAT4X4A* matrices, const u32* transforms, size_t row, const Lanes3& xyz, __m256 w) noexcept
+	{
+		// _MM_TRANSPOSE4_PS on both 128 bit halves at once, leaving transforms n and n + 4 in rows[n]
+		const __m256 xy0 = _mm256_unpacklo_ps(xyz.x, xyz.y);
+		const __m256 xy1 = _mm256_unpackhi_ps(xyz.x, xyz.y);
+		const __m256 zw0 = _mm256_unpacklo_ps(xyz.z, w);
+		const __m256 zw1 = _mm256_unpackhi_ps(xyz.z, w);
+		const __m256 rows[4] = {
+			_mm256_shuffle_ps(xy0, zw0, _MM_SHUFFLE(1, 0, 1, 0)),
+			_mm256_shuffle_ps(xy0, zw0, _MM_SHUFFLE(3, 2, 3, 2)),
+			_mm256_shuffle_ps(xy1, zw1, _MM_SHUFFLE(1, 0, 1, 0)),
+			_mm256_shuffle_ps(xy1, zw1, _MM_SHUFFLE(3, 2, 3, 2)),
+		};
+		for (size_t lane = 0; lane < 4; ++lane)
+		{
+			_mm_store_ps(matrices[transforms[lane]].m[row], _mm256_castps256_ps128(rows[lane]));
+			_mm_store_ps(matrices[transforms[lane + 4]].m[row], _mm256_extractf128_ps(rows[lane], 1));
+		}
+	}
+}
+
+void ggp::ComposeWorldMatricesAVX2(const ComposeBatch& batch) noexcept
+{
+	static_assert(sizeof(LocalTransform) == 10 * sizeof(f32), "gather offsets assume LocalTransform is packed floats");
+	static_assert(sizeof(DirectX::XMFLOAT4X4A) == 16 * sizeof(f32));
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = Splat(1.0f);
+	const f32* const worldBase = &batch.worldMatrices[0].m[0][0];
+
+	size_t i = 0;
+	for (; i + 8 <= batch.count; i += 8)
+	{
+		const u32* const transforms = batch.transforms + i;
+		const __m256i localOffsets = _mm256_mullo_epi32(
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(transforms)), _mm256_set1_epi32(10));
+		const Lanes3 position = GatherLocal(batch.locals, localOffsets, offsetof(LocalTransform, position));
+		const Lanes3 rotation = GatherLocal(batch.locals, localOffsets, offsetof(LocalTransform, rotation));
+		const __m256 rotationW = _mm256_i32gather_ps(
+			reinterpret_cast<const f32*>(reinterpret_cast<const u8*>(batch.locals) + offsetof(LocalTransform, rotation)) + 3, localOffsets, sizeof(f32));
+		const Lanes3 scale = GatherLocal(batch.locals, localOffsets, offsetof(LocalTransform, scale));
+
+		// XMMatrixRotationQuaternion with each row multiplied by its scale, then the translation
+		const __m256 x2 = _mm256_add_ps(rotation.x, rotation.x);
+		const __m256 y2 = _mm256_add_ps(rotation.y, rotation.y);
+		const __m256 z2 = _mm256_add_ps(rotation.z, rotation.z);
+		const __m256 xx = _mm256_mul_ps(rotation.x, x2);
+		const __m256 yy = _mm256_mul_ps(rotation.y, y2);
+		const __m256 zz = _mm256_mul_ps(rotation.z, z2);
+		const __m256 xy = _mm256_mul_ps(rotation.x, y2);
+		const __m256 xz = _mm256_mul_ps(rotation.x, z2);
+		const __m256 yz = _mm256_mul_ps(rotation.y, z2);
+		const __m256 wx = _mm256_mul_ps(rotationW, x2);
+		const __m256 wy = _mm256_mul_ps(rotationW, y2);
+		const __m256 wz = _mm256_mul_ps(rotationW, z2);
+		const Lanes3 local[4] = {
+			Scale(Lanes3{
+				_mm256_sub_ps(_mm256_sub_ps(one, yy), zz),
+				_mm256_add_ps(xy, wz),
+				_mm256_sub_ps(xz, wy),
+			}, scale.x),
+			Scale(Lanes3{
+				_mm256_sub_ps(xy, wz),
+				_mm256_sub_ps(_mm256_sub_ps(one, xx), zz),
+				_mm256_add_ps(yz, wx),
+			}, scale.y),
+			Scale(Lanes3{
+				_mm256_add_ps(xz, wy),
+				_mm256_sub_ps(yz, wx),
+				_mm256_sub_ps(_mm256_sub_ps(one, xx), yy),
+			}, scale.z),
+			position,
+		};
+
+		// gather the parents' world matrices straight into lanes, with identity for transforms which
+		// have no parent. they are affine so their last column is skipped
+		const __m256i parents = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(batch.parents + i));
+		const __m256 hasParent = _mm256_castsi256_ps(_mm256_cmpgt_epi32(parents, _mm256_set1_epi32(-1)));
+		const __m256i parentOffsets = _mm256_slli_epi32(parents, 4);
+		Lanes3 parentRows[4];
+		for (size_t row = 0; row < 4; ++row)
+		{
+			const f32* const rowBase = worldBase + (row * 4);
+			parentRows[row] = Lanes3{
+				_mm256_mask_i32gather_ps(row == 0 ? one : zero, rowBase, parentOffsets, hasParent, sizeof(f32)),
+				_mm256_mask_i32gather_ps(row == 1 ? one : zero, rowBase + 1, parentOffsets, hasParent, sizeof(f32)),
+				_mm256_mask_i32gather_ps(row == 2 ? one : zero, rowBase + 2, parentOffsets, hasParent, sizeof(f32)),
+			};
+		}
+
+		const Lanes3 noTranslation = { zero, zero, zero };
+		const Lanes3 world[4] = {
+			Transform(local[0], parentRows, noTranslation),
+			Transform(local[1], parentRows, noTranslation),
+			Transform(local[2], parentRows, noTranslation),
+			Transform(local[3], parentRows, parentRows[3]),
+		};
+
+		for (size_t row = 0; row < 3; ++row)
+			StoreRow(batch.worldMatrices, transforms, row, world[row], zero);
+		StoreRow(batch.worldMatrices, transforms, 3, world[3], one);
+	}
+
+	if (i < batch.count)
+	{
+		ComposeBatch rest = batch;
+		rest.transforms += i;
+		rest.parents += i;
+		rest.count -= i;
+		ComposeWorldMatricesSSE2(rest);
+	}
+}
+#else
+void ggp::ComposeWorldMatricesAVX2(const ComposeBatch& batch) noexcept
+{
+	// DetectSimdLevel never picks this off of x86
+	ComposeWorldMatricesSSE2(batch);
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,89 @@
+#include "WorkerPool.h"
+#include "errors.h"
+
+#include <algorithm>
+
+u32 ggp::WorkerPool::DefaultWorkerCount() noexcept
+{
+	// hardware_concurrency may return 0 if it does not know
+	const u32 cores = std::thread::hardware_concurrency();
+	return cores > 1 ? cores - 1 : 0;
+}
+
+ggp::WorkerPool::WorkerPool(u32 workerCount) noexcept
+{
+	m_workers.reserve(workerCount);
+	for (u32 i = 0; i < workerCount; ++i)
+		m_workers.emplace_back([this] { WorkerMain(); });
+}
+
+ggp::WorkerPool::~WorkerPool() noexcept
+{
+	{
+		std::lock_guard lock(m_lock);
+		m_stop = true;
+	}
+	m_jobStarted.notify_all();
+	for (std::thread& worker : m_workers)
+		worker.join();
+}
+
+void ggp::WorkerPool::Run(const Job& job) noexcept
+{
+	if (job.count == 0)
+		return;
+	// not worth waking anyone up
+	if (m_workers.empty() || job.count == 1)
+	{
+		for (u32 i = 0; i < job.count; ++i)
+			job.function(job.context, i);
+		return;
+	}
+
+	{
+		std::lock_guard lock(m_lock);
+		gassert(m_busyWorkers == 0, "WorkerPool::ParallelFor is not reentrant");
+		m_job = job;
+		m_nextIndex.store(0, std::memory_order_relaxed);
+		m_busyWorkers = u32(m_workers.size());
+		++m_jobGeneration;
+	}
+	m_jobStarted.notify_all();
+
+	Work(job);
+
+	// every worker has to check in, even if the caller did all the work, before the job and the
+	// index counter can be reused
+	std::unique_lock lock(m_lock);
+	m_jobFinished.wait(lock, [this] { return m_busyWorkers == 0; });
+}
+
+void ggp::WorkerPool::Work(const Job& job) noexcept
+{
+	for (u32 i = m_nextIndex.fetch_add(1, std::memory_order_relaxed); i < job.count;
+		i = m_nextIndex.fetch_add(1, std::memory_order_relaxed))
+	{
+		job.function(job.context, i);
+	}
+}
+
+void ggp::WorkerPool::WorkerMain() noexcept
+{
+	u64 finishedGeneration = 0;
+	std::unique_lock lock(m_lock);
+	while (true)
+	{
+		m_jobStarted.wait(lock, [&] { return m_stop || m_jobGeneration != finishedGeneration; });
+		if (m_stop)
+			return;
+		finishedGeneration = m_jobGeneration;
+		const Job job = m_job;
+
+		lock.unlock();
+		Work(job);
+		lock.lock();
+
+		if (--m_busyWorkers == 0)
+			m_jobFinished.notify_one();
+	}
+}
\ No newline at end of file
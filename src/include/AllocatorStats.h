@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include "short_numbers.h"
+
+// allocator telemetry only exists in debug builds, unless explicitly turned on or off
+#if !defined(GGP_ALLOCATOR_STATS)
+#if defined(DEBUG) || defined(_DEBUG)
+#define GGP_ALLOCATOR_STATS 1
+#else
+#define GGP_ALLOCATOR_STATS 0
+#endif
+#endif
+
+// wrap any statement which touches allocator stats in this so it disappears from release builds
+#if GGP_ALLOCATOR_STATS
+#define GGP_ALLOCATOR_STAT(...) __VA_ARGS__
+#else
+#define GGP_ALLOCATOR_STAT(...)
+#endif
+
+#if GGP_ALLOCATOR_STATS
+namespace ggp
+{
+	class BlockAllocator;
+
+	/// <summary>
+	/// Counters kept by every block allocator. They are relaxed atomics so that they can be bumped from
+	/// any thread the allocator is used from. Blocks sitting in a ThreadCache count as live.
+	/// </summary>
+	class AllocatorStats
+	{
+	public:
+		struct GrowEvent
+		{
+			std::chrono::steady_clock::time_point time;
+			size_t oldCommittedBytes;
+			size_t newCommittedBytes;
+		};
+
+		static constexpr size_t maxGrowEvents = 16;
+
+		/// <summary>
+		/// A plain copy of the counters of one allocator at one point in time, for displaying.
+		/// </summary>
+		struct Snapshot
+		{
+			const char* name;
+			size_t blockSize;
+			u64 liveBlocks;
+			u64 peakLiveBlocks;
+			u64 committedBytes;
+			u64 peakCommittedBytes;
+			u64 reservedBytes;
+			u64 growCount;
+			u64 failedAllocations;
+			u64 invalidFrees;
+			// fraction of free blocks which share a page with a live block, so their memory cannot be
+			// given back to the OS. negative if it could not be measured
+			f32 fragmentation;
+			// oldest first
+			std::array<GrowEvent, maxGrowEvents> recentGrowEvents;
+			size_t recentGrowEventCount;
+		};
+
+		AllocatorStats() noexcept = default;
+		AllocatorStats(const AllocatorStats&) = delete;
+		AllocatorStats& operator=(const AllocatorStats&) = delete;
+
+		// used when moving an allocator
+		void TakeFrom(AllocatorStats& other) noexcept;
+
+		void OnAlloc(u64 count) noexcept;
+		inline void OnFree(u64 count) noexcept { m_liveBlocks.fetch_sub(count, std::memory_order_relaxed); }
+		inline void OnFailedAlloc() noexcept { m_failedAllocations.fetch_add(1, std::memory_order_relaxed); }
+		inline void OnInvalidFree() noexcept { m_invalidFrees.fetch_add(1, std::memory_order_relaxed); }
+		inline void SetReserved(size_t bytes) noexcept { m_reservedBytes.store(bytes, std::memory_order_relaxed); }
+		// the committed size changed without growing (initial commit, trimming)
+		void SetCommitted(size_t bytes) noexcept;
+		void OnGrow(size_t oldCommittedBytes, size_t newCommittedBytes) noexcept;
+
+		// fills in everything except name, blockSize and fragmentation
+		void FillSnapshot(Snapshot& out) const noexcept;
+
+	private:
+		std::atomic<u64> m_liveBlocks = 0;
+		std::atomic<u64> m_peakLiveBlocks = 0;
+		std::atomic<u64> m_committedBytes = 0;
+		std::atomic<u64> m_peakCommittedBytes = 0;
+		std::atomic<u64> m_reservedBytes = 0;
+		std::atomic<u64> m_failedAllocations = 0;
+		std::atomic<u64> m_invalidFrees = 0;
+
+		mutable std::mutex m_growEventsLock;
+		// ring buffer, m_growCount % maxGrowEvents is the next slot to write
+		std::array<GrowEvent, maxGrowEvents> m_growEvents = {};
+		u64 m_growCount = 0;
+	};
+
+	/// <summary>
+	/// Keeps track of every live block allocator so they can be listed in debug UI.
+	/// </summary>
+	class AllocatorRegistry
+	{
+	public:
+		static void Register(BlockAllocator*) noexcept;
+		static void Unregister(BlockAllocator*) noexcept;
+
+		/// <summary>
+		/// Get the stats of every registered allocator. Walks each allocator's free blocks to measure
+		/// fragmentation, so this is not cheap.
+		/// </summary>
+		static std::vector<AllocatorStats::Snapshot> SnapshotAll() noexcept;
+	};
+}
+#endif
\ No newline at end of file
@@ -1,15 +1,57 @@
 #pragma once
 
 #include <span>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <vector>
+#include <climits>
 #include "short_numbers.h"
 #include "errors.h"
 #include "memutils.h"
+#include "ggp_bitset.h"
+#include "AllocatorStats.h"
 
 namespace ggp
 {
 	class BlockAllocator
 	{
 	public:
+		enum class Concurrency : u8
+		{
+			// Alloc and Free may only ever be called from one thread at a time. No locking is done.
+			SingleThreaded,
+			// the shared free list is protected by a lock, so Alloc and Free may be called from any
+			// thread.
+			Locked,
+			// Alloc and Free are lock-free: the free list head is an index + ABA tag which is swapped
+			// with a CAS. Only growing the allocator takes a lock.
+			LockFree,
+		};
+
+		enum class TrimPolicy : u8
+		{
+			// memory is only ever given back to the OS when the allocator is destroyed
+			Never,
+			// a live block count is kept for every page so that Trim() can be called
+			Manual,
+			// same as Manual, but Free() calls Trim() once a page empties out while less than a quarter
+			// of the committed blocks are in use
+			Automatic,
+		};
+
+		enum class AllocationPolicy : u8
+		{
+			// intrusive LIFO free list. cheapest, but after a lot of churn live blocks end up scattered
+			// all over the committed memory
+			FreeList,
+			// free blocks are tracked in a bitmap and Alloc always returns the lowest free block, so
+			// live blocks stay packed at the front. Not supported with Concurrency::LockFree
+			LowestAddress,
+		};
+
 		struct Options {
 			size_t maxBytes;
 			size_t initialBytes;
@@ -18,6 +60,99 @@ namespace ggp
 			// 3 = 8 bytes, 4 = 16 bytes, 5 = 32 bytes, 6 = 64 bytes
 			// the number must be at least 3 and can be at most 7
 			u8 minimumAlignmentExponent = 3;
+			Concurrency concurrency = Concurrency::SingleThreaded;
+			// not supported with Concurrency::LockFree, which may read free blocks at any time
+			TrimPolicy trimPolicy = TrimPolicy::Never;
+			AllocationPolicy allocationPolicy = AllocationPolicy::FreeList;
+			// reserve and commit in large page (typically 2MB) granules, so big allocators take fewer
+			// TLB misses. falls back to normal pages where large pages are unavailable, which
+			// currently includes windows. maxBytes and initialBytes get rounded up to the large page size
+			bool largePages = false;
+			// keep a helper thread around which commits, prefaults and links up the next growth step as
+			// soon as the previous one is used, so growing never page faults on the allocating thread
+			bool precommitAhead = false;
+			// what this allocator is called in the allocator stats panel (debug builds only)
+			const char* debugName = nullptr;
+		};
+
+		/// <summary>
+		/// Result of Compact(): where each block that was live before compaction lives now.
+		/// </summary>
+		struct RelocationTable
+		{
+			// indexed by the old block index. free blocks map to UINT32_MAX, live blocks that did not
+			// move map to themselves
+			std::vector<u32> newIndices;
+			// after compaction, blocks [0, liveBlocks) are live and everything after is free
+			u32 liveBlocks = 0;
+			u32 movedBlocks = 0;
+
+			inline u32 Relocate(u32 oldIndex) const noexcept
+			{
+				if (oldIndex >= newIndices.size())
+					return oldIndex;
+				gassert(newIndices[oldIndex] != UINT32_MAX, "relocating a block which was not live during compaction");
+				return newIndices[oldIndex];
+			}
+		};
+
+		/// <summary>
+		/// A small per-thread magazine of blocks sitting in front of a Locked or LockFree block allocator. Blocks are
+		/// taken from and given back to the shared free list in batches, so the lock is only touched once
+		/// every few dozen allocations. Meant to be owned by a worker thread (or declared thread_local),
+		/// and must be destroyed before the allocator it caches for.
+		/// </summary>
+		class ThreadCache
+		{
+		public:
+			explicit ThreadCache(BlockAllocator& allocator) noexcept;
+			~ThreadCache() noexcept;
+
+			ThreadCache(const ThreadCache&) = delete;
+			ThreadCache& operator=(const ThreadCache&) = delete;
+			ThreadCache(ThreadCache&&) = delete;
+			ThreadCache& operator=(ThreadCache&&) = delete;
+
+			std::span<u8> Alloc() noexcept;
+			void Free(std::span<u8> mem) noexcept;
+
+			/// <summary>
+			/// Return every block held by this cache to the shared free list.
+			/// </summary>
+			void Flush() noexcept;
+
+			template <typename T, typename ...Args>
+			inline T* Create(Args&&... args) noexcept
+			{
+				static_assert(std::is_trivially_destructible_v<T>, "ThreadCache::create will call constructor of a type which it cannot destruct");
+				if (!m_allocator->CanHold<T>()) [[unlikely]]
+				{
+					gassert(false, "Attempt to create type with block allocator, but its too big or too aligned");
+					return nullptr;
+				}
+
+				T* const out = reinterpret_cast<T*>(Alloc().data());
+				if (!out) [[unlikely]]
+					return nullptr;
+				new (out) T(std::forward<Args>(args)...);
+				return out;
+			}
+
+			template <typename T>
+			inline void Destroy(T* object) noexcept
+			{
+				static_assert(std::is_trivially_destructible_v<T>, "Cannot destroy object which has destructor trollface");
+				Free({ (u8*)object, m_allocator->m_blockSize });
+			}
+
+		private:
+			// number of blocks moved to or from the shared free list at once
+			static constexpr size_t batchSize = 16;
+			static constexpr size_t capacity = batchSize * 2;
+
+			BlockAllocator* m_allocator;
+			std::array<u8*, capacity> m_blocks;
+			size_t m_count = 0;
 		};
 
 		BlockAllocator(const BlockAllocator&) = delete;
@@ -33,6 +168,53 @@ namespace ggp
 		std::span<u8> Alloc() noexcept;
 		void Free(std::span<u8> mem) noexcept;
 
+		/// <summary>
+		/// Allocate out.size() blocks at once. Any growth needed is committed in one go, and the lock (if
+		/// any) is only taken once. All or nothing: on failure nothing is allocated.
+		/// </summary>
+		/// <param name="out">Receives a pointer to each of the allocated blocks, every one m_blockSize bytes.</param>
+		/// <returns>False if the allocator cannot fit that many more blocks.</returns>
+		bool AllocN(std::span<u8*> out) noexcept;
+
+		/// <summary>
+		/// Free a batch of blocks, taking the lock (or doing the lock-free publish) only once.
+		/// </summary>
+		void FreeN(std::span<u8* const> blocks) noexcept;
+
+		/// <summary>
+		/// Decommit the empty pages at the end of the allocator. Some slack is left behind so that a
+		/// following allocation does not immediately grow again, and the allocator never shrinks below
+		/// Options::initialBytes. Requires a TrimPolicy other than Never.
+		/// </summary>
+		/// <returns>The number of bytes given back to the OS.</returns>
+		size_t Trim() noexcept;
+
+		/// <summary>
+		/// Move live blocks down into the lowest free slots (with memcpy, so the contents must be
+		/// trivially relocatable) so that all live blocks are packed at the front, then Trim() if the
+		/// TrimPolicy allows it. Every pointer or index into this allocator is invalidated, the owner
+		/// is responsible for fixing them up with the returned table. Not supported with
+		/// Concurrency::LockFree, and no ThreadCache may be holding blocks when this is called.
+		/// </summary>
+		RelocationTable Compact() noexcept;
+
+		inline size_t GetBlockSize() const noexcept { return m_blockSize; }
+		inline size_t GetBlockAlignment() const noexcept { return size_t(1) << m_minAlignmentExponent; }
+
+#if GGP_ALLOCATOR_STATS
+		/// <summary>
+		/// Copy out the telemetry counters. Measuring fragmentation walks every free block (under the
+		/// lock, if any), and is skipped in lock-free mode where the free list cannot be walked safely.
+		/// </summary>
+		void GetStatsSnapshot(AllocatorStats::Snapshot& out) noexcept;
+#endif
+
+		template <typename T>
+		inline constexpr bool CanHold() const noexcept
+		{
+			return sizeof(T) <= m_blockSize && alignof(T) <= (u64(1UL) << m_minAlignmentExponent);
+		}
+
 		template <typename T>
 		inline u32 GetIndexFromPointer(T* item) const noexcept
 		{
@@ -57,7 +239,7 @@ namespace ggp
 		inline T* Create(Args&&... args) noexcept
 		{
 			static_assert(std::is_trivially_destructible_v<T>, "BlockAllocator::create will call constructor of a type which it cannot destruct");
-			if (sizeof(T) > m_blockSize || alignof(T) > (u64(1UL) << m_minAlignmentExponent)) [[unlikely]]
+			if (!CanHold<T>()) [[unlikely]]
 			{
 				gassert(false, "Attempt to create type with block allocator, but its too big or too aligned");
 				return nullptr;
@@ -83,6 +265,43 @@ namespace ggp
 			Free({ (u8*)object, m_blockSize } );
 		}
 
+		/// <summary>
+		/// Construct out.size() objects of type T with one call to AllocN. Every object is constructed
+		/// from the same arguments.
+		/// </summary>
+		/// <returns>False if the allocator could not fit them all, in which case nothing was created.</returns>
+		template <typename T, typename ...Args>
+		inline bool CreateN(std::span<T*> out, const Args&... args) noexcept
+		{
+			static_assert(std::is_trivially_destructible_v<T>, "BlockAllocator::CreateN will call constructor of a type which it cannot destruct");
+			if (!CanHold<T>()) [[unlikely]]
+			{
+				gassert(false, "Attempt to create type with block allocator, but its too big or too aligned");
+				return false;
+			}
+
+			// T* and u8* have the same representation, so the output can double as the block list
+			if (!AllocN({ reinterpret_cast<u8**>(out.data()), out.size() })) [[unlikely]]
+				return false;
+
+			if constexpr (sizeof...(Args) > 0 || !std::is_trivially_constructible_v<T>)
+			{
+				for (T* object : out)
+				{
+					gassert(is_aligned_to_type(object), "implementation of block allocator is broken and produced misaligned ptr");
+					new (object) T(args...);
+				}
+			}
+			return true;
+		}
+
+		template <typename T>
+		inline void DestroyN(std::span<T* const> objects) noexcept
+		{
+			static_assert(std::is_trivially_destructible_v<T>, "Cannot destroy object which has destructor trollface");
+			FreeN({ reinterpret_cast<u8* const*>(objects.data()), objects.size() });
+		}
+
 	private:
 
 		struct EmptyBlock
@@ -90,9 +309,66 @@ namespace ggp
 			u64 nextEmpty;
 		};
 
-		// returns true if capacity grew, or false if already at max
-		bool GrowCapacity() noexcept;
+		// the actual free list manipulation, callers are responsible for locking if needed
+		std::span<u8> AllocUnsynchronized() noexcept;
+		void FreeUnsynchronized(std::span<u8> mem) noexcept;
+		// pop out.size() blocks, which must already be available
+		void PopBlocksUnsynchronized(std::span<u8*> out) noexcept;
+		// commit enough pages for count blocks to be free, in one step. if the allocator cannot get
+		// that big it grows as far as it can and returns false
+		bool ReserveFreeBlocks(size_t count) noexcept;
+
+		// take the lock once and move up to out.size() blocks off of the shared free list. returns
+		// the number of blocks written to out
+		size_t RefillCache(std::span<u8*> out) noexcept;
+
+		// lock-free versions of the free list, used when m_concurrency == LockFree
+		std::span<u8> AllocLockFree() noexcept;
+		void FreeLockFree(std::span<u8> mem) noexcept;
+		// push an already linked chain of blocks onto the lock-free list with a single CAS
+		void PushChainLockFree(u32 first, u32 last) noexcept;
+
+		// the free list head for LockFree mode: low 32 bits are the index of the first empty block,
+		// high 32 bits are a tag which is bumped on every change so that a stale CAS cannot succeed
+		static constexpr u32 nullIndex = UINT32_MAX;
+		static inline constexpr u64 PackHead(u32 index, u32 tag) noexcept { return (u64(tag) << 32) | index; }
+		static inline constexpr u32 HeadIndex(u64 head) noexcept { return u32(head); }
+		static inline constexpr u32 HeadTag(u64 head) noexcept { return u32(head >> 32); }
+
+		bool IsValidBlock(std::span<u8> mem, std::span<u8> range) const noexcept;
+
+		// add delta to the live count of every page that the given block touches. returns true if
+		// one of those pages is now empty
+		bool UpdatePageOccupancy(size_t blockIndex, i32 delta) noexcept;
+		size_t TrimUnsynchronized() noexcept;
+		RelocationTable CompactUnsynchronized() noexcept;
+		// shrink m_memory down to the given number of pages, giving the rest back to the OS
+		void DecommitTail(size_t newCommittedPages) noexcept;
+		// the free bitmap if there is one, otherwise walks the free list to fill in scratch
+		const HierarchicalBitset& GetFreeBits(HierarchicalBitset& scratch) const noexcept;
+#if GGP_ALLOCATOR_STATS
+		f32 MeasureFragmentationUnsynchronized() const noexcept;
+#endif
+
+		// returns true if capacity grew, or false if already at max. grows to at least minimumPages
+		bool GrowCapacity(size_t minimumPages = 0) noexcept;
+		// how many pages will be committed after growing from committedPages
+		size_t NextGrowthPages(size_t committedPages, size_t minimumPages) const noexcept;
+
+		void StartPrecommitThread() noexcept;
+		void StopPrecommitThread() noexcept;
+		// give all of our memory back and stop the precommit thread, leaving an empty allocator behind
+		void Release() noexcept;
+		void PrecommitThreadMain() noexcept;
+		// slow path of LockFree mode, takes the lock and only grows if the list is still empty
+		bool GrowCapacityLockFree() noexcept;
 		EmptyBlock* GetBlockAt(size_t i) const noexcept;
+		// these do not look at m_memory, which may be being resized by another thread in LockFree mode
+		EmptyBlock* GetReservedBlockAt(size_t i) const noexcept;
+		inline u32 GetReservedIndex(u8* block) const noexcept
+		{
+			return u32((block - m_reservedMemory.data()) / m_blockSize);
+		}
 
 		std::span<u8> m_memory;
 		std::span<u8> m_reservedMemory;
@@ -100,6 +376,34 @@ namespace ggp
 		size_t m_blockSize;
 		size_t m_blocksFree;
 		size_t m_lastFree;
+		size_t m_minimumPages;
 		u8 m_minAlignmentExponent;
+		Concurrency m_concurrency;
+		TrimPolicy m_trimPolicy;
+		AllocationPolicy m_allocationPolicy;
+		// one bit per block, set if free. only used with AllocationPolicy::LowestAddress
+		HierarchicalBitset m_freeBits;
+		// number of live blocks overlapping each reserved page, empty if m_trimPolicy is Never
+		std::vector<u32> m_pageLiveCounts;
+		std::atomic<u64> m_freeHead;
+		// not moved along with the allocator, moving an allocator that other threads are using is not allowed
+		std::mutex m_sharedLock;
+
+		bool m_precommitAhead = false;
+		// everything below is protected by m_precommitLock. the precommit thread prepares the bytes
+		// [m_precommitStart, m_precommitEnd) of m_reservedMemory, which start right after m_memory
+		std::thread m_precommitThread;
+		std::mutex m_precommitLock;
+		std::condition_variable m_precommitSignal;
+		size_t m_precommitStart = 0;
+		size_t m_precommitEnd = 0;
+		bool m_precommitRequested = false;
+		bool m_precommitStop = false;
+
+#if GGP_ALLOCATOR_STATS
+		// mutable so that the const validity checks can count invalid frees
+		mutable AllocatorStats m_stats;
+		const char* m_debugName = nullptr;
+#endif
 	};
 }
\ No newline at end of file
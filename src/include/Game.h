@@ -17,6 +17,9 @@
 #include "Sky.h"
 #include "ggp_com_pointer.h"
 #include "ggp_dict.h"
+#include "LinearArena.h"
+#include "WorkerPool.h"
+#include "memutils.h"
 
 namespace ggp
 {
@@ -55,12 +58,19 @@ namespace ggp
 		bool m_spinningEnabled = true;
 		std::array<float, 4> m_backgroundColor = { 0 };
 
+		// transient per-frame allocations, reset at the start of Update()
+		FrameArena m_frameArena{ LinearArena::Options{ .maxBytes = 64_MB, .initialBytes = 1_MB } };
+
 		dict<std::unique_ptr<Mesh>> m_meshes;
 		dict<std::unique_ptr<Material>> m_materials;
 		dict<com_p<ID3D11ShaderResourceView>> m_textureViews;
 		com_p<ID3D11SamplerState> m_defaultSampler;
 		std::vector<Entity> m_entities;
 		TransformHierarchy* m_transformHierarchy;
+		// spreads the per frame transform update over every core
+		WorkerPool m_workerPool;
+		// how many world matrices changed in the last frame, for the debug menu
+		size_t m_changedTransformCount = 0;
 
 		size_t m_activeCamera;
 		std::vector<std::shared_ptr<Camera>> m_cameras;
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <span>
+#include <array>
+#include <new>
+#include <cstddef>
+#include <type_traits>
+#include "short_numbers.h"
+#include "errors.h"
+
+namespace ggp
+{
+	/// <summary>
+	/// A bump allocator over one big virtual memory reservation. Pages are committed as the arena
+	/// grows and stay committed after a Reset(), so once warmed up an allocation is just a pointer bump.
+	/// Nothing is freed individually and no destructors are run.
+	/// </summary>
+	class LinearArena
+	{
+	public:
+		struct Options
+		{
+			size_t maxBytes;
+			size_t initialBytes = 0;
+		};
+
+		// a position in the arena which it can be rolled back to
+		using Marker = size_t;
+
+		LinearArena(const LinearArena&) = delete;
+		LinearArena& operator=(const LinearArena&) = delete;
+
+		LinearArena(LinearArena&&) noexcept;
+		LinearArena& operator=(LinearArena&&) noexcept;
+
+		LinearArena(const Options&) noexcept;
+
+		~LinearArena() noexcept;
+
+		/// <summary>
+		/// Get uninitialized memory from the arena.
+		/// </summary>
+		/// <param name="alignment">Must be a power of two no larger than the page size.</param>
+		/// <returns>nullptr if the arena's reservation is full.</returns>
+		inline void* Alloc(size_t bytes, size_t alignment = alignof(std::max_align_t)) noexcept
+		{
+			gassert(alignment != 0 && (alignment & (alignment - 1)) == 0, "arena alignment must be a power of two");
+			// the reservation is page aligned, so aligning the offset aligns the pointer
+			const size_t start = (m_used + alignment - 1) & ~(alignment - 1);
+			const size_t end = start + bytes;
+			if (end > m_memory.size()) [[unlikely]]
+			{
+				if (!Grow(end))
+					return nullptr;
+			}
+			m_used = end;
+			return m_memory.data() + start;
+		}
+
+		/// <summary>
+		/// Get uninitialized space for count objects of type T. Consecutive calls for the same T with
+		/// nothing else allocated in between are contiguous.
+		/// </summary>
+		template <typename T>
+		inline T* AllocArray(size_t count) noexcept
+		{
+			static_assert(std::is_trivially_destructible_v<T>, "LinearArena never runs destructors");
+			return reinterpret_cast<T*>(Alloc(sizeof(T) * count, alignof(T)));
+		}
+
+		template <typename T, typename ...Args>
+		inline T* Create(Args&&... args) noexcept
+		{
+			static_assert(std::is_trivially_destructible_v<T>, "LinearArena never runs destructors");
+			T* const out = AllocArray<T>(1);
+			if (!out) [[unlikely]]
+				return nullptr;
+			new (out) T(std::forward<Args>(args)...);
+			return out;
+		}
+
+		/// <summary>
+		/// printf into the arena. The string lives until the arena is reset past it.
+		/// </summary>
+		const char* Format(const char* format, ...) noexcept;
+
+		inline Marker GetMarker() const noexcept { return m_used; }
+
+		/// <summary>
+		/// Throw away everything allocated since the marker was taken.
+		/// </summary>
+		inline void ResetToMarker(Marker marker) noexcept
+		{
+			gassert(marker <= m_used, "arena marker is from the future, was the arena reset since?");
+			m_used = marker;
+		}
+
+		/// <summary>
+		/// Throw away everything. Committed pages are kept for reuse.
+		/// </summary>
+		inline void Reset() noexcept { m_used = 0; }
+
+		inline size_t BytesUsed() const noexcept { return m_used; }
+		inline size_t BytesCommitted() const noexcept { return m_memory.size(); }
+
+	private:
+		// commit at least up to neededBytes, returns false if that is past the reservation
+		bool Grow(size_t neededBytes) noexcept;
+		// give the reservation back to the OS, leaving an empty arena behind
+		void Release() noexcept;
+
+		std::span<u8> m_memory;
+		std::span<u8> m_reservedMemory;
+		size_t m_pageSize;
+		size_t m_used = 0;
+	};
+
+	/// <summary>
+	/// Two linear arenas which swap every frame. Allocations from Current() are valid for the rest of
+	/// this frame and all of the next one (through Previous()), so per-frame data can be handed over
+	/// to the following frame without copying.
+	/// </summary>
+	class FrameArena
+	{
+	public:
+		explicit FrameArena(const LinearArena::Options&) noexcept;
+
+		/// <summary>
+		/// Call once at the start of every frame. Throws away everything allocated two frames ago.
+		/// </summary>
+		inline void NewFrame() noexcept
+		{
+			m_current ^= 1;
+			m_arenas[m_current].Reset();
+		}
+
+		inline LinearArena& Current() noexcept { return m_arenas[m_current]; }
+		inline LinearArena& Previous() noexcept { return m_arenas[m_current ^ 1]; }
+
+	private:
+		std::array<LinearArena, 2> m_arenas;
+		u8 m_current = 0;
+	};
+}
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 #include <DirectXMath.h>
 #include <memory>
+#include <vector>
 #include "TransformHierarchy.h"
 
 namespace ggp
@@ -28,13 +29,30 @@ namespace ggp
 
 		// tree modification
 		Transform AddChild() noexcept;
+		// add count children at once, appending them to out
+		void AddChildren(u32 count, std::vector<Transform>& out) noexcept;
 		void Destroy() noexcept;
+		// destroy this transform and all of its descendants
+		void DestroySubtree() noexcept;
+		// bake this transform and its descendants, see TransformHierarchy::MarkStatic
+		void MarkStatic() noexcept;
+		bool IsStatic() const noexcept;
+
+		// update this transform's handle after TransformHierarchy::Compact()
+		void Relocate(const BlockAllocator::RelocationTable&) noexcept;
 
 		// matrix calculation (requires some tree traversal unless cached)
 		const DirectX::XMFLOAT4X4* GetWorldMatrixPtr() noexcept;
 		const DirectX::XMFLOAT4X4* GetWorldInverseTransposeMatrixPtr() noexcept;
+		// no cleaning, only valid if the transform has not been modified since TransformHierarchy::UpdateAll()
+		inline const DirectX::XMFLOAT4X4* GetCachedWorldMatrixPtr() const noexcept;
+		inline const DirectX::XMFLOAT4X4* GetCachedWorldInverseTransposeMatrixPtr() const noexcept;
 		DirectX::XMFLOAT4X4 GetWorldMatrix();
 		DirectX::XMFLOAT4X4 GetWorldInverseTransposeMatrix();
+		// read out of a frame from TransformHierarchy::PublishFrame(), which is safe from another thread
+		inline const DirectX::XMFLOAT4X4* GetPublishedWorldMatrixPtr(const TransformHierarchy::PublishedFrame&) const noexcept;
+		// fills in the frame's inverse transpose if it has to, see TransformHierarchy::PublishedFrame
+		inline const DirectX::XMFLOAT4X4* GetPublishedWorldInverseTransposeMatrixPtr(TransformHierarchy::PublishedFrame&) const noexcept;
 	
 		// setters
 		void SetLocalPosition(float x, float y, float z);
@@ -43,6 +61,7 @@ namespace ggp
 		void SetLocalEulerAngles(float x, float y, float z);
 		void SetLocalEulerAngles(DirectX::XMFLOAT3 rotation);
 		inline void TH_VECTORCALL StoreLocalEulerAngles(DirectX::FXMVECTOR angles) noexcept;
+		inline void TH_VECTORCALL StoreLocalRotationQuat(DirectX::FXMVECTOR quat) noexcept;
 		void SetLocalScale(float x, float y, float z);
 		void SetLocalScale(DirectX::XMFLOAT3 scale);
 		inline void TH_VECTORCALL StoreLocalScale(DirectX::FXMVECTOR scale) noexcept;
@@ -52,6 +71,7 @@ namespace ggp
 		void SetEulerAngles(float pitch, float yaw, float roll);
 		void SetEulerAngles(DirectX::XMFLOAT3 rotation);
 		inline void TH_VECTORCALL StoreEulerAngles(DirectX::FXMVECTOR angles) noexcept;
+		inline void TH_VECTORCALL StoreRotationQuat(DirectX::FXMVECTOR quat) noexcept;
 		void SetScale(float x, float y, float z);
 		void SetScale(DirectX::XMFLOAT3 scale);
 		inline void TH_VECTORCALL StoreScale(DirectX::FXMVECTOR scale) noexcept;
@@ -61,12 +81,14 @@ namespace ggp
 		inline DirectX::XMVECTOR LoadLocalPosition() const noexcept;
 		DirectX::XMFLOAT3 GetLocalEulerAngles() const;
 		inline DirectX::XMVECTOR LoadLocalEulerAngles() const noexcept;
+		inline DirectX::XMVECTOR LoadLocalRotationQuat() const noexcept;
 		DirectX::XMFLOAT3 GetLocalScale() const;
 		inline DirectX::XMVECTOR LoadLocalScale() const noexcept;
 		DirectX::XMFLOAT3 GetPosition() const;
 		inline DirectX::XMVECTOR LoadPosition() const noexcept;
 		DirectX::XMFLOAT3 GetEulerAngles() const;
 		inline DirectX::XMVECTOR LoadEulerAngles() const noexcept;
+		inline DirectX::XMVECTOR LoadRotationQuat() const noexcept;
 		DirectX::XMFLOAT3 GetScale() const;
 		inline DirectX::XMVECTOR LoadScale() const noexcept;
 		DirectX::XMFLOAT3 GetForward() const;
@@ -123,6 +145,26 @@ namespace ggp
 		return internals::hierarchy->LoadMatrixDecomposed(handle, outPos, outQuat, outScale);
 	}
 
+	inline const DirectX::XMFLOAT4X4* Transform::GetCachedWorldMatrixPtr() const noexcept
+	{
+		return internals::hierarchy->GetCachedWorldMatrixPtr(handle);
+	}
+
+	inline const DirectX::XMFLOAT4X4* Transform::GetCachedWorldInverseTransposeMatrixPtr() const noexcept
+	{
+		return internals::hierarchy->GetCachedWorldInverseTransposeMatrixPtr(handle);
+	}
+
+	inline const DirectX::XMFLOAT4X4* Transform::GetPublishedWorldMatrixPtr(const TransformHierarchy::PublishedFrame& frame) const noexcept
+	{
+		return frame.GetWorldMatrixPtr(handle);
+	}
+
+	inline const DirectX::XMFLOAT4X4* Transform::GetPublishedWorldInverseTransposeMatrixPtr(TransformHierarchy::PublishedFrame& frame) const noexcept
+	{
+		return frame.GetWorldInverseTransposeMatrixPtr(handle);
+	}
+
 	inline DirectX::XMVECTOR Transform::LoadLocalPosition() const noexcept
 	{
 		return internals::hierarchy->LoadLocalPosition(handle);
@@ -133,6 +175,11 @@ namespace ggp
 		return internals::hierarchy->LoadLocalEulerAngles(handle);
 	}
 
+	inline DirectX::XMVECTOR Transform::LoadLocalRotationQuat() const noexcept
+	{
+		return internals::hierarchy->LoadLocalRotationQuat(handle);
+	}
+
 	inline DirectX::XMVECTOR Transform::LoadLocalScale() const noexcept
 	{
 		return internals::hierarchy->LoadLocalScale(handle);
@@ -148,6 +195,11 @@ namespace ggp
 		return internals::hierarchy->LoadEulerAngles(handle);
 	}
 
+	inline DirectX::XMVECTOR Transform::LoadRotationQuat() const noexcept
+	{
+		return internals::hierarchy->LoadRotationQuat(handle);
+	}
+
 	inline DirectX::XMVECTOR Transform::LoadScale() const noexcept
 	{
 		return internals::hierarchy->LoadScale(handle);
@@ -163,6 +215,11 @@ namespace ggp
 		internals::hierarchy->StoreEulerAngles(handle, angles);
 	}
 
+	inline void TH_VECTORCALL Transform::StoreRotationQuat(DirectX::FXMVECTOR quat) noexcept
+	{
+		internals::hierarchy->StoreRotationQuat(handle, quat);
+	}
+
 	inline void TH_VECTORCALL Transform::StoreScale(DirectX::FXMVECTOR scale) noexcept
 	{
 		internals::hierarchy->StoreScale(handle, scale);
@@ -178,6 +235,11 @@ namespace ggp
 		internals::hierarchy->StoreLocalEulerAngles(handle, angles);
 	}
 
+	inline void TH_VECTORCALL Transform::StoreLocalRotationQuat(DirectX::FXMVECTOR quat) noexcept
+	{
+		internals::hierarchy->StoreLocalRotationQuat(handle, quat);
+	}
+
 	inline void TH_VECTORCALL Transform::StoreLocalScale(DirectX::FXMVECTOR scale) noexcept
 	{
 		internals::hierarchy->StoreLocalScale(handle, scale);
@@ -185,35 +247,17 @@ namespace ggp
 
 	inline DirectX::XMVECTOR Transform::LoadForward() const noexcept
 	{
-		using namespace DirectX;
-		XMVECTOR out;
-		XMVECTOR quat;
-		XMVECTOR scale;
-		LoadMatrixDecomposed(&out, &quat, &scale);
-		out = XMVectorSet(0, 0, 1, 0);
-		return XMVector3Rotate(out, quat);
+		return internals::hierarchy->LoadForward(handle);
 	}
 
 	inline DirectX::XMVECTOR Transform::LoadRight() const noexcept
-	{	
-		using namespace DirectX;
-		XMVECTOR out;
-		XMVECTOR quat;
-		XMVECTOR scale;
-		LoadMatrixDecomposed(&out, &quat, &scale);
-		out = XMVectorSet(1, 0, 0, 0);
-		return XMVector3Rotate(out, quat);
+	{
+		return internals::hierarchy->LoadRight(handle);
 	}
 
 	inline DirectX::XMVECTOR Transform::LoadUp() const noexcept
 	{
-		using namespace DirectX;
-		XMVECTOR out;
-		XMVECTOR quat;
-		XMVECTOR scale;
-		LoadMatrixDecomposed(&out, &quat, &scale);
-		out = XMVectorSet(0, 1, 0, 0);
-		return XMVector3Rotate(out, quat);
+		return internals::hierarchy->LoadUp(handle);
 	}
 
 	inline void TH_VECTORCALL Transform::ScaleVec(DirectX::FXMVECTOR scale) noexcept
@@ -225,17 +269,8 @@ namespace ggp
 	inline void TH_VECTORCALL Transform::RotateLocalVec(DirectX::FXMVECTOR eulerAngles) noexcept
 	{
 		using namespace DirectX;
-		// convert to quat
-		XMVECTOR current = XMQuaternionRotationRollPitchYawFromVector(LoadLocalEulerAngles());
 		XMVECTOR diff = XMQuaternionRotationRollPitchYawFromVector(eulerAngles);
-
-		// actual rotation
-		current = XMQuaternionMultiply(diff, current);
-
-		// store, quattoeuler doesnt use simd
-		XMFLOAT4 q;
-		XMStoreFloat4(&q, current);
-		SetLocalEulerAngles(QuatToEuler(q));
+		StoreLocalRotationQuat(XMQuaternionMultiply(diff, LoadLocalRotationQuat()));
 	}
 
 	inline void TH_VECTORCALL Transform::MoveAbsoluteLocalVec(DirectX::FXMVECTOR offset) noexcept
@@ -261,12 +296,9 @@ namespace ggp
 	inline void TH_VECTORCALL Transform::MoveRelativeVec(DirectX::FXMVECTOR offset) noexcept
 	{
 		using namespace DirectX;
-		XMVECTOR pos;
-		XMVECTOR rotated;
-		XMVECTOR scale;
-		LoadMatrixDecomposed(&pos, &rotated, &scale);
-		// since LoadMatrix gives the global rotation, we are rotating the global space offset into our local space
-		rotated = XMVector3Rotate(offset, rotated);
+		// the offset is along our own axes, so walk it along each of them in global space
+		const XMVECTOR rotated = XMVectorMultiplyAdd(XMVectorSplatX(offset), LoadRight(),
+			XMVectorMultiplyAdd(XMVectorSplatY(offset), LoadUp(), XMVectorMultiply(XMVectorSplatZ(offset), LoadForward())));
 		// rotated value already in global space, so it can be applied directly to our local position and it will still be global
 		MoveAbsoluteLocalVec(rotated);
 	}
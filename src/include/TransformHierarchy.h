@@ -2,11 +2,18 @@
 
 #include <DirectXMath.h>
 
+#include <array>
+#include <atomic>
 #include <vector>
 #include <optional>
+#include <span>
 
 #include "BlockAllocator.h"
+#include "LinearArena.h"
+#include "ggp_bitset.h"
 #include "ggp_math.h"
+#include "TransformUpdate.h"
+#include "WorkerPool.h"
 
 #define TH_VECTORCALL __vectorcall
 
@@ -27,6 +34,55 @@ namespace ggp
 			inline constexpr Handle(u32 idx) noexcept : _inner(idx) {}
 		};
 
+		/// <summary>
+		/// A copy of every world matrix as of one PublishFrame() call. It does not change while the next
+		/// frame is simulated, so a render thread can read it while the hierarchy is being modified. The
+		/// const functions can be called from any number of threads at once.
+		/// </summary>
+		class PublishedFrame
+		{
+		public:
+			inline const DirectX::XMFLOAT4X4* GetWorldMatrixPtr(Handle h) const noexcept
+			{
+				gassert(h._inner >= 0 && u32(h._inner) < m_count, "transform created after this frame was published");
+				return &m_worldMatrices[h._inner];
+			}
+			// inverse transposes which were not worked out before publishing are computed by the first read
+			// and kept in the frame, so this one writes to it and only one thread may call it for a frame
+			inline const DirectX::XMFLOAT4X4* GetWorldInverseTransposeMatrixPtr(Handle h) noexcept
+			{
+				gassert(h._inner >= 0 && u32(h._inner) < m_count, "transform created after this frame was published");
+				if (m_inverseTransposeDirty->Test(size_t(h._inner)))
+				{
+					const DirectX::XMMATRIX inverseTranspose =
+						ComputeWorldInverseTranspose(DirectX::XMLoadFloat4x4A(&m_worldMatrices[h._inner]));
+					DirectX::XMStoreFloat4x4A(&m_worldInverseTransposeMatrices[h._inner], inverseTranspose);
+					m_inverseTransposeDirty->Clear(size_t(h._inner));
+				}
+				return &m_worldInverseTransposeMatrices[h._inner];
+			}
+			// same as the above without writing to the frame, so other threads work it out every time instead
+			inline DirectX::XMFLOAT4X4 GetWorldInverseTransposeMatrix(Handle h) const noexcept
+			{
+				gassert(h._inner >= 0 && u32(h._inner) < m_count, "transform created after this frame was published");
+				if (!m_inverseTransposeDirty->Test(size_t(h._inner)))
+					return m_worldInverseTransposeMatrices[h._inner];
+				DirectX::XMFLOAT4X4 out;
+				DirectX::XMStoreFloat4x4(&out, ComputeWorldInverseTranspose(DirectX::XMLoadFloat4x4A(&m_worldMatrices[h._inner])));
+				return out;
+			}
+			// counts up from 1, 0 if nothing has been published yet
+			inline u64 GetFrameNumber() const noexcept { return m_frameNumber; }
+
+		private:
+			friend class TransformHierarchy;
+			const DirectX::XMFLOAT4X4A* m_worldMatrices = nullptr;
+			DirectX::XMFLOAT4X4A* m_worldInverseTransposeMatrices = nullptr;
+			HierarchicalBitset* m_inverseTransposeDirty = nullptr;
+			u32 m_count = 0;
+			u64 m_frameNumber = 0;
+		};
+
 		TransformHierarchy() noexcept;
 
 		/// <summary>
@@ -43,11 +99,85 @@ namespace ggp
 
 		// tree modification
 		Handle AddChild(Handle) noexcept;
+		/// <summary>
+		/// Add count children to a transform with a single allocation, appending their handles to out.
+		/// </summary>
+		void AddChildren(Handle, u32 count, std::vector<Handle>& out) noexcept;
+		/// <summary>
+		/// Free a transform. Its children are kept, and become roots which stay where they were in world space.
+		/// </summary>
 		void Destroy(Handle) noexcept;
+		/// <summary>
+		/// Free a transform and everything under it, in one pass without any matrix math. Every handle into the
+		/// subtree is invalid afterwards.
+		/// </summary>
+		void DestroySubtree(Handle) noexcept;
+
+		/// <summary>
+		/// Bake the world matrices of a transform and its whole subtree, and never update them again. Static
+		/// transforms are left out of dirty propagation and UpdateAll, and must not be modified afterwards. That
+		/// includes by their ancestors: if a dynamic parent moves, a static child stays where it was baked.
+		/// Children added to a static transform later are baked and static too.
+		/// </summary>
+		void MarkStatic(Handle) noexcept;
+		inline bool IsStatic(Handle h) const noexcept { return m_static.Test(size_t(h._inner)); }
+
+		/// <summary>
+		/// Pack all live transforms into the front of the hierarchy's memory and give the rest of the
+		/// pages back to the OS. Every handle which was created before this call must be passed through
+		/// RelocateHandle with the returned table before it is used again.
+		/// </summary>
+		BlockAllocator::RelocationTable Compact() noexcept;
+		static Handle RelocateHandle(Handle, const BlockAllocator::RelocationTable&) noexcept;
+
+		/// <summary>
+		/// Recalculate the world matrix of every transform which was invalidated since the last call. The
+		/// transforms are kept in parent-first order, so finding them is one linear sweep over the subtrees of
+		/// the transforms that were actually modified. They are then computed a whole depth at a time, several
+		/// per instruction. Call once a frame before rendering, after which the GetCached* functions can be
+		/// used until the next modification.
+		/// </summary>
+		/// <param name="pool">If given, big levels are split up over its threads. The results are identical
+		/// either way.</param>
+		void UpdateAll(WorkerPool* pool = nullptr) noexcept;
+
+		/// <summary>
+		/// Copy the world matrices (and any inverse transposes already worked out) which changed into the back buffer, and
+		/// make it the one GetPublishedFrame() returns. Only the transforms that changed in the last two
+		/// frames are copied. Call on the update thread after UpdateAll(). The previously published frame
+		/// is overwritten by the next call, so its readers must be done with it by then.
+		/// </summary>
+		void PublishFrame() noexcept;
+		/// <summary>
+		/// The most recently published frame. Safe to call from any thread.
+		/// </summary>
+		PublishedFrame GetPublishedFrame() const noexcept;
+
+		/// <summary>
+		/// Every transform whose world matrix changed since the last call, including new ones, each listed
+		/// once. Transforms destroyed in the meantime are left out. Call after UpdateAll() so that nothing is
+		/// still waiting to be recalculated, and refresh whatever depends on just these transforms.
+		/// </summary>
+		/// <returns>Valid until the next call, or until Compact().</returns>
+		std::span<const Handle> ConsumeChanges() noexcept;
 
 		const DirectX::XMFLOAT4X4* GetWorldMatrixPtr(Handle) const noexcept;
+		// the inverse transpose is not kept up to date with the world matrix, it is worked out the first
+		// time it is asked for after each change. so these are not safe to call from several threads at once
 		const DirectX::XMFLOAT4X4* GetWorldInverseTransposeMatrixPtr(Handle) const noexcept;
 
+		// same as the above but never cleans, the transform must not have been modified since UpdateAll()
+		inline const DirectX::XMFLOAT4X4* GetCachedWorldMatrixPtr(Handle h) const noexcept
+		{
+			gassert(!IsDirty(h), "cached world matrix read from a transform modified since UpdateAll()");
+			return &GetWorld(h);
+		}
+		inline const DirectX::XMFLOAT4X4* GetCachedWorldInverseTransposeMatrixPtr(Handle h) const noexcept
+		{
+			gassert(!IsDirty(h), "cached world matrix read from a transform modified since UpdateAll()");
+			return &GetWorldInverseTranspose(h);
+		}
+
 		inline void LoadMatrixDecomposed(
 			Handle,
 			DirectX::XMVECTOR* outPos,
@@ -58,12 +188,19 @@ namespace ggp
 		inline DirectX::XMVECTOR LoadPosition(Handle) const noexcept;
 		DirectX::XMFLOAT3 GetEulerAngles(Handle) const;
 		inline DirectX::XMVECTOR LoadEulerAngles(Handle) const noexcept;
+		inline DirectX::XMVECTOR LoadRotationQuat(Handle) const noexcept;
 		DirectX::XMFLOAT3 GetScale(Handle) const;
 		inline DirectX::XMVECTOR LoadScale(Handle) const noexcept;
+		// unit length world space axes, the rows of the world matrix
+		inline DirectX::XMVECTOR LoadForward(Handle) const noexcept;
+		inline DirectX::XMVECTOR LoadRight(Handle) const noexcept;
+		inline DirectX::XMVECTOR LoadUp(Handle) const noexcept;
 		DirectX::XMFLOAT3 GetLocalPosition(Handle) const;
 		inline DirectX::XMVECTOR LoadLocalPosition(Handle) const noexcept;
 		DirectX::XMFLOAT3 GetLocalEulerAngles(Handle) const;
 		inline DirectX::XMVECTOR LoadLocalEulerAngles(Handle) const noexcept;
+		// rotations are stored as quaternions, so these skip the conversion the euler angle versions do
+		inline DirectX::XMVECTOR LoadLocalRotationQuat(Handle) const noexcept;
 		DirectX::XMFLOAT3 GetLocalScale(Handle) const;
 		inline DirectX::XMVECTOR LoadLocalScale(Handle) const noexcept;
 
@@ -71,61 +208,207 @@ namespace ggp
 		inline void TH_VECTORCALL StorePosition(Handle, DirectX::FXMVECTOR pos) noexcept;
 		void SetEulerAngles(Handle, DirectX::XMFLOAT3 rotation);
 		inline void TH_VECTORCALL StoreEulerAngles(Handle, DirectX::FXMVECTOR rotation) noexcept;
+		inline void TH_VECTORCALL StoreRotationQuat(Handle, DirectX::FXMVECTOR quat) noexcept;
 		void SetScale(Handle, DirectX::XMFLOAT3 scale);
 		inline void TH_VECTORCALL StoreScale(Handle, DirectX::FXMVECTOR scale) noexcept;
 		void SetLocalPosition(Handle, DirectX::XMFLOAT3 position);
 		inline void TH_VECTORCALL StoreLocalPosition(Handle, DirectX::FXMVECTOR pos) noexcept;
 		void SetLocalEulerAngles(Handle, DirectX::XMFLOAT3 rotation);
 		inline void TH_VECTORCALL StoreLocalEulerAngles(Handle, DirectX::FXMVECTOR angles) noexcept;
+		inline void TH_VECTORCALL StoreLocalRotationQuat(Handle, DirectX::FXMVECTOR quat) noexcept;
 		void SetLocalScale(Handle, DirectX::XMFLOAT3 scale);
 		inline void TH_VECTORCALL StoreLocalScale(Handle, DirectX::FXMVECTOR scale) noexcept;
 
 
 	private:
-		struct InternalTransform
+		// a transform's data is split up by how it is used, and each part lives in its own array indexed
+		// by the handle. the links are the block allocator's blocks, so a free handle is a free block,
+		// and the other arrays are sized to cover every block
+		// the block allocator stores its free list in free blocks, which needs 8 byte alignment
+		struct alignas(8) Links
 		{
-			DirectX::XMFLOAT3 localPosition = {};
-			DirectX::XMFLOAT3 localRotation = {};
-			DirectX::XMFLOAT3 localScale = { 1, 1, 1 };
-			DirectX::XMFLOAT4X4A worldMatrix;
-			DirectX::XMFLOAT4X4A worldInverseTransposeMatrix;
 			i32 parentHandle = -1;
+			// siblings are a doubly linked list so that any of them can be unlinked without a search. the
+			// roots are linked to each other the same way
+			i32 prevSiblingHandle = -1;
 			i32 nextSiblingHandle = -1;
 			i32 childHandle = -1;
 			u32 childCount = 0;
-			bool isDirty = false;
-
-			InternalTransform() noexcept;
 		};
 
-		inline constexpr InternalTransform* GetPtr(Handle h) const noexcept
+		static constexpr size_t maxTransforms = 1 << 20;
+		static constexpr size_t minimumCapacity = 1024;
+
+		inline constexpr Links* GetLinks(Handle h) const noexcept
 		{
-			return (InternalTransform*)m_transformAllocator.GetPointerFromIndex(h._inner);
+			return (Links*)m_linkAllocator.GetPointerFromIndex(h._inner);
+		}
+		inline LocalTransform& GetLocal(Handle h) const noexcept { return m_locals[h._inner]; }
+		inline DirectX::XMFLOAT4X4A& GetWorld(Handle h) const noexcept { return m_worldMatrices[h._inner]; }
+		inline bool IsDirty(Handle h) const noexcept { return m_dirty.Test(size_t(h._inner)); }
+		// the world getters read straight out of the world matrix instead of decomposing it
+		inline const DirectX::XMFLOAT4X4A& GetCleanWorld(Handle h) const noexcept
+		{
+			if (IsDirty(h))
+				Clean(h._inner);
+			return GetWorld(h);
+		}
+		// the world matrix must be clean
+		inline DirectX::XMFLOAT4X4A& GetWorldInverseTranspose(Handle h) const noexcept
+		{
+			if (m_inverseTransposeDirty.Test(size_t(h._inner)))
+			{
+				const DirectX::XMMATRIX inverseTranspose = ComputeWorldInverseTranspose(DirectX::XMLoadFloat4x4A(&GetWorld(h)));
+				DirectX::XMStoreFloat4x4A(&m_worldInverseTransposeMatrices[h._inner], inverseTranspose);
+				m_inverseTransposeDirty.Clear(size_t(h._inner));
+			}
+			return m_worldInverseTransposeMatrices[h._inner];
 		}
 
 		inline constexpr bool IsNull(Handle h) const noexcept { return h._inner < 0; }
+		// remember that a transform's world matrix has to be copied by the next PublishFrame(), and
+		// returned by the next ConsumeChanges()
+		inline void NoteWorldChanged(u32 transform) const noexcept
+		{
+			if (!m_unpublishedBits.Test(transform))
+			{
+				m_unpublishedBits.Set(transform);
+				m_unpublished.push_back(transform);
+			}
+			if (!m_changedBits.Test(transform))
+			{
+				m_changedBits.Set(transform);
+				m_changes.push_back(Handle(transform));
+			}
+		}
 
-		// take a dirty transform and move up until finding the earliest clean ancestor, then propagate all changes down, cleaning
-		// any passed children on the way. stops when it cleans the target transform
+		// grow the parallel arrays so that index is in bounds
+		void EnsureCapacity(u32 index) noexcept;
+		// reset the data of a newly allocated transform to identity
+		void InitTransform(u32 index, bool dirty) noexcept;
+		// disconnect a transform from its parent and siblings, or from the roots
+		void Unlink(Handle) noexcept;
+		// add a transform without a parent to the front of the root list
+		void LinkRoot(u32 transform) noexcept;
+		// finish a transform which was just added under a static parent
+		void BakeStaticChild(u32 transform) noexcept;
+
+		// take a dirty transform and move up until finding the nearest clean ancestor, then propagate all changes down from its
+		// world matrix, cleaning any passed ancestors on the way so their other children can start from them. stops when it
+		// cleans the target transform
 		void Clean(u32 transform) const noexcept;
+		// calculate and store the world matrix of a transform whose parent is clean, and return it
+		DirectX::XMMATRIX TH_VECTORCALL CleanFromParent(u32 transform, DirectX::FXMMATRIX parentWorld) const noexcept;
 
-		// recursively mark a transform and all children as dirty. in theory this is super
-		// innefficient bc linked list + bools in structs, every node read is a cache line evicted.
-		// TODO: benchmark stuff, probably
+		// add a transform to m_dirtyRoots if it is not in there already
+		inline void PushDirtyRoot(u32 transform) const noexcept
+		{
+			if (m_dirtyRootBits.Test(transform))
+				return;
+			m_dirtyRootBits.Set(transform);
+			m_dirtyRoots.push_back(transform);
+		}
+		// true if anything was modified since UpdateAll
+		inline bool HasDirtyRoots() const noexcept { return m_dirtyRootBits.FindFirstSet() != HierarchicalBitset::npos; }
+
+		// mark a transform and its subtree as dirty, skipping any part of the subtree which is already
+		// dirty or static. does nothing if the transform itself is already dirty, since then so is its whole
+		// subtree. a static transform must not be passed in, and keeps its baked world matrix if it is
 		void MarkDirty(u32 transform) const noexcept;
 
-		struct DirtyStackFrame
+		// lay every transform out in depth first order, so that parents come before their children and
+		// every subtree is one contiguous range
+		void RebuildOrder() noexcept;
+
+		// recalculate [begin, end) of the batch UpdateAll put together
+		void ComposeRange(u32 begin, u32 end) const noexcept;
+
+		// how many transforms UpdateAll gives a worker at once. a multiple of every kernel's width, so
+		// splitting a level up does not change which transforms are computed together
+		static constexpr u32 parallelChunkSize = 512;
+
+		// picked once for the CPU it is running on
+		ComposeWorldMatricesFunction m_composeWorldMatrices = GetComposeWorldMatrices(DetectSimdLevel());
+
+		// scratch space for Clean's chain of ancestors and the stacks of MarkDirty and RebuildOrder (for recursing
+		// into the tree without using call stack recursion). reset back to empty when any of them returns
+		mutable LinearArena m_scratch;
+		BlockAllocator m_linkAllocator;
+		// one reservation per array, so each can grow in place without moving
+		LinearArena m_localArena;
+		LinearArena m_worldArena;
+		LinearArena m_worldInverseTransposeArena;
+		LocalTransform* m_locals = nullptr;
+		DirectX::XMFLOAT4X4A* m_worldMatrices = nullptr;
+		DirectX::XMFLOAT4X4A* m_worldInverseTransposeMatrices = nullptr;
+		// one bit per transform, set if its world matrix is out of date
+		mutable HierarchicalBitset m_dirty;
+		// one bit per transform, set if its world matrix has changed since its inverse transpose was worked out
+		mutable HierarchicalBitset m_inverseTransposeDirty;
+		// one bit per transform, set if MarkStatic has baked it. every descendant of a static transform is static
+		HierarchicalBitset m_static;
+		u32 m_capacity = 0;
+		// every transform passed to MarkDirty while it was still clean or created dirty, since the last UpdateAll.
+		// their subtrees contain every dirty transform
+		mutable std::vector<u32> m_dirtyRoots;
+		// one bit per transform, set if it is in m_dirtyRoots. destroying a transform only clears its bit,
+		// and UpdateAll drops the entries whose bit is clear
+		mutable HierarchicalBitset m_dirtyRootBits;
+		// the first transform without a parent, the rest follow through their sibling links
+		i32 m_firstRoot = -1;
+		// handles in depth first order, and the number of transforms in the subtree starting at each one.
+		// rebuilt by UpdateAll after the shape of the tree changes
+		std::vector<u32> m_order;
+		std::vector<u32> m_subtreeSizes;
+		// position of each handle in m_order
+		std::vector<u32> m_orderIndex;
+		// depth of the transform at each position in m_order, roots are 0
+		std::vector<u32> m_depths;
+		u32 m_maxDepth = 0;
+		bool m_orderValid = false;
+		// UpdateAll's list of dirty transforms, grouped by depth so that each group only depends on the ones
+		// before it. kept around to reuse the memory
+		std::vector<u32> m_dirtyPositions;
+		std::vector<u32> m_batchTransforms;
+		std::vector<i32> m_batchParents;
+		std::vector<u32> m_levelEnds;
+
+		// one of the two copies of the world matrices that PublishFrame() alternates between
+		struct PublishedBuffer
 		{
-			i32 transform = -1;
-			u8 triedChild = false;
-			u8 triedSibling = false;
+			LinearArena worldArena;
+			LinearArena worldInverseTransposeArena;
+			DirectX::XMFLOAT4X4A* worldMatrices = nullptr;
+			DirectX::XMFLOAT4X4A* worldInverseTransposeMatrices = nullptr;
+			// one bit per transform, set if its inverse transpose was not copied and is left to the reader
+			HierarchicalBitset inverseTransposeDirty;
+			u32 capacity = 0;
+			u64 frameNumber = 0;
 		};
-
-		// when calling Clean, we push handles to this during it and then clear it when Clean is done
-		mutable std::vector<u32> m_cleaningArena;
-		// for recursing into the tree without using call stack recursion, we still need a stack of some kind
-		mutable std::vector<DirtyStackFrame> m_dirtyStack;
-		BlockAllocator m_transformAllocator;
+		static PublishedBuffer CreatePublishedBuffer() noexcept;
+
+		// mutable since reading the front buffer's inverse transposes can fill them in
+		mutable std::array<PublishedBuffer, 2> m_published;
+		// index into m_published of the frame readers see. the back buffer is only written by PublishFrame()
+		std::atomic<u32> m_frontBuffer = 0;
+		u64 m_publishedFrames = 0;
+		// every transform whose world matrix changed since the last PublishFrame(), and one bit per transform
+		// set if it is in the list
+		mutable std::vector<u32> m_unpublished;
+		mutable HierarchicalBitset m_unpublishedBits;
+		// the transforms the last PublishFrame() copied, which the back buffer (published the frame before)
+		// is still missing
+		std::vector<u32> m_lastPublished;
+		// how many more PublishFrame() calls have to copy every transform, since Compact() moved them all
+		u32 m_fullPublishes = 0;
+
+		// every transform whose world matrix changed since the last ConsumeChanges(), and one bit per
+		// transform set if it is in the list. destroying a transform clears its bit but leaves it in the
+		// list, so ConsumeChanges() only returns the entries whose bit is still set
+		mutable std::vector<Handle> m_changes;
+		mutable HierarchicalBitset m_changedBits;
+		// what the last ConsumeChanges() returned
+		std::vector<Handle> m_consumedChanges;
 	};
 
 	// inline simd function definitions -----------------------------------------------------
@@ -135,19 +418,26 @@ namespace ggp
 		// using assert so that this goes away in release mode, to avoid potentially calling functins and messing with registers
 		// this does not match up with non inlined functions which always do abort_if to null check
 		gassert(!IsNull(h), "attempt to get local position of null transform");
-		return DirectX::XMLoadFloat3(&GetPtr(h)->localPosition);
+		return DirectX::XMLoadFloat3(&GetLocal(h).position);
 	}
 
 	inline DirectX::XMVECTOR TransformHierarchy::LoadLocalEulerAngles(Handle h) const noexcept
 	{
 		gassert(!IsNull(h), "attempt to get local euler angles of null transform");
-		return DirectX::XMLoadFloat3(&GetPtr(h)->localRotation);
+		const DirectX::XMFLOAT3 angles = QuatToEuler(GetLocal(h).rotation);
+		return DirectX::XMLoadFloat3(&angles);
+	}
+
+	inline DirectX::XMVECTOR TransformHierarchy::LoadLocalRotationQuat(Handle h) const noexcept
+	{
+		gassert(!IsNull(h), "attempt to get local rotation of null transform");
+		return DirectX::XMLoadFloat4(&GetLocal(h).rotation);
 	}
 
 	inline DirectX::XMVECTOR TransformHierarchy::LoadLocalScale(Handle h) const noexcept
 	{
 		gassert(!IsNull(h), "attempt to get local scale of null transform");
-		return DirectX::XMLoadFloat3(&GetPtr(h)->localScale);
+		return DirectX::XMLoadFloat3(&GetLocal(h).scale);
 	}
 
 	inline void TH_VECTORCALL TransformHierarchy::StoreLocalPosition(Handle h, DirectX::FXMVECTOR pos) noexcept
@@ -156,7 +446,7 @@ namespace ggp
 		gassert(!IsNull(h), "attempt to change the local position of null transform");
 		gassert(!XMVector3IsNaN(pos));
 		gassert(!XMVector3IsInfinite(pos));
-		XMStoreFloat3(&GetPtr(h)->localPosition, pos);
+		XMStoreFloat3(&GetLocal(h).position, pos);
 		MarkDirty(h._inner);
 	}
 
@@ -166,7 +456,18 @@ namespace ggp
 		gassert(!IsNull(h), "attempt to change the local euler angles of null transform");
 		gassert(!XMVector3IsNaN(angles));
 		gassert(!XMVector3IsInfinite(angles));
-		XMStoreFloat3(&GetPtr(h)->localRotation, angles);
+		XMStoreFloat4(&GetLocal(h).rotation, XMQuaternionRotationRollPitchYawFromVector(angles));
+		MarkDirty(h._inner);
+	}
+
+	inline void TH_VECTORCALL TransformHierarchy::StoreLocalRotationQuat(Handle h, DirectX::FXMVECTOR quat) noexcept
+	{
+		using namespace DirectX;
+		gassert(!IsNull(h), "attempt to change the local rotation of null transform");
+		gassert(!XMVector4IsNaN(quat));
+		gassert(!XMVector4IsInfinite(quat));
+		// renormalized so that rotations built up over many frames do not drift into scaling
+		XMStoreFloat4(&GetLocal(h).rotation, XMQuaternionNormalize(quat));
 		MarkDirty(h._inner);
 	}
 
@@ -176,7 +477,7 @@ namespace ggp
 		gassert(!IsNull(h), "attempt to change the local euler angles of null transform");
 		gassert(!XMVector3IsNaN(scale));
 		gassert(!XMVector3IsInfinite(scale));
-		XMStoreFloat3(&GetPtr(h)->localScale, scale);
+		XMStoreFloat3(&GetLocal(h).scale, scale);
 		MarkDirty(h._inner);
 	}
 
@@ -187,12 +488,10 @@ namespace ggp
 		DirectX::XMVECTOR* outScale) const noexcept
 	{
 		gassert(!IsNull(h), "attempt to load the matrix of null transform");
-		auto* trans = GetPtr(h);
-
-		if (trans->isDirty)
+		if (IsDirty(h))
 			Clean(h._inner);
 
-		DirectX::XMMATRIX mat = XMLoadFloat4x4(&trans->worldMatrix);
+		DirectX::XMMATRIX mat = XMLoadFloat4x4(&GetWorld(h));
 		const bool success = XMMatrixDecompose(outScale, outQuat, outPos, mat);
 		// TODO: switch to propagating by transform instead of by matrix, or implement a decompose w/ skew
 		// see https://gabormakesgames.com/blog_transforms_matrices.html
@@ -202,13 +501,10 @@ namespace ggp
 	inline DirectX::XMVECTOR TransformHierarchy::LoadPosition(Handle h) const noexcept
 	{
 		using namespace DirectX;
-		XMVECTOR pos;
-		XMVECTOR quat;
-		XMVECTOR scale;
-		LoadMatrixDecomposed(h, &pos, &quat, &scale);
-		gassert(!XMVector3IsNaN(scale));
+		gassert(!IsNull(h), "attempt to load the position of null transform");
+		// the translation row, w included like XMMatrixDecompose would give it
+		const XMVECTOR pos = XMLoadFloat4A(reinterpret_cast<const XMFLOAT4A*>(GetCleanWorld(h).m[3]));
 		gassert(!XMVector3IsNaN(pos));
-		gassert(!XMVector3IsNaN(quat));
 		return pos;
 	}
 
@@ -216,68 +512,95 @@ namespace ggp
 	{
 		using namespace DirectX;
 		gassert(!IsNull(h), "Attempt to load euler angles from null transform");
-		auto* trans = GetPtr(h);
-		if (trans->isDirty)
+		if (IsDirty(h))
 			Clean(h._inner);
 
-		XMVECTOR rot = ExtractEulersFromMatrix(&trans->worldMatrix);
+		XMVECTOR rot = ExtractEulersFromMatrix(&GetWorld(h));
 		gassert(!XMVector3IsNaN(rot));
 		return rot;
 	}
 
+	inline DirectX::XMVECTOR TransformHierarchy::LoadRotationQuat(Handle h) const noexcept
+	{
+		using namespace DirectX;
+		gassert(!IsNull(h), "attempt to load the rotation of null transform");
+		// the basis rows with the scale divided back out. assumes there is no skew, like LoadMatrixDecomposed
+		const XMMATRIX world = XMLoadFloat4x4A(&GetCleanWorld(h));
+		const XMMATRIX rotation(
+			XMVector3Normalize(world.r[0]),
+			XMVector3Normalize(world.r[1]),
+			XMVector3Normalize(world.r[2]),
+			g_XMIdentityR3.v);
+		const XMVECTOR quat = XMQuaternionRotationMatrix(rotation);
+		gassert(!XMVector4IsNaN(quat));
+		return quat;
+	}
+
 	inline DirectX::XMVECTOR TransformHierarchy::LoadScale(Handle h) const noexcept
 	{
 		using namespace DirectX;
-		XMVECTOR pos;
-		XMVECTOR quat;
-		XMVECTOR scale;
-		LoadMatrixDecomposed(h, &pos, &quat, &scale);
+		gassert(!IsNull(h), "attempt to load the scale of null transform");
+		// the lengths of the basis rows, summed up a lane per row. always positive, unlike
+		// LoadMatrixDecomposed which flips one axis for a mirrored matrix
+		const XMMATRIX columns = XMMatrixTranspose(XMLoadFloat4x4A(&GetCleanWorld(h)));
+		const XMVECTOR lengthsSquared = XMVectorMultiplyAdd(columns.r[0], columns.r[0],
+			XMVectorMultiplyAdd(columns.r[1], columns.r[1], XMVectorMultiply(columns.r[2], columns.r[2])));
+		// the last lane is the translation
+		const XMVECTOR scale = XMVectorSelect(XMVectorZero(), XMVectorSqrt(lengthsSquared), g_XMSelect1110);
 		gassert(!XMVector3IsNaN(scale));
-		gassert(!XMVector3IsNaN(pos));
-		gassert(!XMVector3IsNaN(quat));
 		return scale;
 	}
 
+	inline DirectX::XMVECTOR TransformHierarchy::LoadForward(Handle h) const noexcept
+	{
+		gassert(!IsNull(h), "attempt to load the forward vector of null transform");
+		return DirectX::XMVector3Normalize(DirectX::XMLoadFloat4A(reinterpret_cast<const DirectX::XMFLOAT4A*>(GetCleanWorld(h).m[2])));
+	}
+
+	inline DirectX::XMVECTOR TransformHierarchy::LoadRight(Handle h) const noexcept
+	{
+		gassert(!IsNull(h), "attempt to load the right vector of null transform");
+		return DirectX::XMVector3Normalize(DirectX::XMLoadFloat4A(reinterpret_cast<const DirectX::XMFLOAT4A*>(GetCleanWorld(h).m[0])));
+	}
+
+	inline DirectX::XMVECTOR TransformHierarchy::LoadUp(Handle h) const noexcept
+	{
+		gassert(!IsNull(h), "attempt to load the up vector of null transform");
+		return DirectX::XMVector3Normalize(DirectX::XMLoadFloat4A(reinterpret_cast<const DirectX::XMFLOAT4A*>(GetCleanWorld(h).m[1])));
+	}
+
 	inline void TH_VECTORCALL TransformHierarchy::StorePosition(Handle h, DirectX::FXMVECTOR pos) noexcept
 	{
 		using namespace DirectX;
+		gassert(!IsNull(h), "attempt to change the position of null transform");
+		const i32 parent = GetLinks(h)->parentHandle;
+		if (IsNull(parent))
+		{
+			StoreLocalPosition(h, pos);
+			return;
+		}
 
-		auto* trans = GetPtr(h);
-		auto* worldStorage = GetWorldMatrixPtr(h);
-		XMMATRIX world = XMLoadFloat4x4(worldStorage);
-
-		// get our contribution to world space
-		XMMATRIX local = XMMatrixMultiply(
-			XMMatrixMultiply(
-				XMMatrixScalingFromVector(XMLoadFloat3(&trans->localScale)),
-				XMMatrixRotationRollPitchYawFromVector(XMLoadFloat3(&trans->localRotation))),
-			XMMatrixTranslationFromVector(XMLoadFloat3(&trans->localPosition)));
-		// revert our contribution from world, getting the space that our position is in
-		world = XMMatrixMultiply(XMMatrixInverse(nullptr, local), world);
-
-		// translate the global position into this parent space
-		XMVECTOR localPos = XMVector3Transform(pos, world);
-		StoreLocalPosition(h, localPos);
+		// translate the global position into the parent's space, which our position is in
+		const XMMATRIX parentWorld = XMLoadFloat4x4A(&GetCleanWorld(parent));
+		StoreLocalPosition(h, XMVector3Transform(pos, XMMatrixInverse(nullptr, parentWorld)));
 	}
 
 	inline void TH_VECTORCALL TransformHierarchy::StoreEulerAngles(Handle h, DirectX::FXMVECTOR angles) noexcept
+	{
+		StoreRotationQuat(h, DirectX::XMQuaternionRotationRollPitchYawFromVector(angles));
+	}
+
+	inline void TH_VECTORCALL TransformHierarchy::StoreRotationQuat(Handle h, DirectX::FXMVECTOR quat) noexcept
 	{
 		using namespace DirectX;
-		XMVECTOR localQuat; // innaccurate name, at first
-		XMVECTOR globalQuat;
-		XMVECTOR targetQuat; // innaccurate name, at first
-		LoadMatrixDecomposed(h, &localQuat, &globalQuat, &targetQuat);
-
-		targetQuat = XMQuaternionRotationRollPitchYawFromVector(angles);
-		localQuat = XMQuaternionRotationRollPitchYawFromVector(LoadLocalEulerAngles(h));
-		// "subtract" the contribution of the local angles- effectively the parent's global rotation
-		globalQuat = XMQuaternionMultiply(globalQuat, XMQuaternionInverse(localQuat));
-		// target is now delta-to-target
-		targetQuat = XMQuaternionMultiply(targetQuat, XMQuaternionInverse(globalQuat));
-
-		XMFLOAT4 quaternionForm;
-		XMStoreFloat4(&quaternionForm, targetQuat);
-		SetLocalEulerAngles(h, QuatToEuler(quaternionForm));
+		gassert(!IsNull(h), "attempt to change the rotation of null transform");
+		const XMVECTOR globalQuat = LoadRotationQuat(h);
+
+		// global is local followed by the parent's rotation, so "subtract" the local rotation off of the
+		// front to get the parent's global rotation
+		const XMVECTOR parentQuat = XMQuaternionMultiply(XMQuaternionInverse(LoadLocalRotationQuat(h)), globalQuat);
+		// then the local rotation which is followed by the parent's to land on the target
+		StoreLocalRotationQuat(h, XMQuaternionMultiply(quat, XMQuaternionInverse(parentQuat)));
 	}
 
 	inline void TH_VECTORCALL TransformHierarchy::StoreScale(Handle h, DirectX::FXMVECTOR scale) noexcept
@@ -285,11 +608,7 @@ namespace ggp
 		using namespace DirectX;
 		gassert(!XMVector3IsNaN(scale));
 		// modifying global scale should modify local scale, but just do it in global space.
-		XMVECTOR outPos;
-		XMVECTOR outQuat;
-		XMVECTOR outScale;
-		LoadMatrixDecomposed(h, &outPos, &outQuat, &outScale);
-		gassert(!XMVector3IsNaN(outScale));
+		const XMVECTOR outScale = LoadScale(h);
 		const XMVECTOR localScale = LoadLocalScale(h);
 		// difference between the target global scale and our global scale
 		const XMVECTOR delta = XMVectorSubtract(scale, outScale);
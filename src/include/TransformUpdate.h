@@ -0,0 +1,84 @@
+#pragma once
+
+#include <DirectXMath.h>
+
+#include "short_numbers.h"
+#include "errors.h"
+
+namespace ggp
+{
+	struct LocalTransform
+	{
+		DirectX::XMFLOAT3 position = {};
+		// unit quaternion, euler angles are only converted to and from at the API
+		DirectX::XMFLOAT4 rotation = { 0, 0, 0, 1 };
+		DirectX::XMFLOAT3 scale = { 1, 1, 1 };
+	};
+
+	/// <summary>
+	/// A list of transforms whose world matrices should be recalculated from their local transforms and
+	/// their parents' world matrices. No transform in the list may be the parent of another one in the
+	/// list, so that they can all be computed side by side. Transforms of the same depth always qualify.
+	/// </summary>
+	struct ComposeBatch
+	{
+		const u32* transforms;
+		// the parent of each transform, or negative for no parent
+		const i32* parents;
+		size_t count;
+		// all indexed by transform
+		const LocalTransform* locals;
+		DirectX::XMFLOAT4X4A* worldMatrices;
+	};
+
+	using ComposeWorldMatricesFunction = void(*)(const ComposeBatch&) noexcept;
+
+	enum class SimdLevel : u8
+	{
+		Scalar,
+		// four transforms at a time, with DirectXMath
+		SSE2,
+		// eight transforms at a time
+		AVX2,
+	};
+
+	/// <summary>
+	/// Find the widest SimdLevel which the CPU and OS support. Only checks once.
+	/// </summary>
+	SimdLevel DetectSimdLevel() noexcept;
+	ComposeWorldMatricesFunction GetComposeWorldMatrices(SimdLevel) noexcept;
+
+	// one transform at a time, the reference the wider versions are checked against
+	void ComposeWorldMatricesScalar(const ComposeBatch&) noexcept;
+	void ComposeWorldMatricesSSE2(const ComposeBatch&) noexcept;
+	// only call if DetectSimdLevel() returned at least AVX2
+	void ComposeWorldMatricesAVX2(const ComposeBatch&) noexcept;
+
+	/// <summary>
+	/// The inverse transpose of an affine world matrix, for transforming normals. When the matrix has no
+	/// skew or non-uniform scale that is just the matrix over its scale squared, so nothing is inverted.
+	/// </summary>
+	DirectX::XMMATRIX XM_CALLCONV ComputeWorldInverseTranspose(DirectX::FXMMATRIX world) noexcept;
+
+	inline DirectX::XMMATRIX XM_CALLCONV ComposeWorldMatrix(const LocalTransform& local, DirectX::FXMMATRIX parentWorld) noexcept
+	{
+		using namespace DirectX;
+		const XMVECTOR localPosition = XMLoadFloat3(&local.position);
+		const XMVECTOR localRotation = XMLoadFloat4(&local.rotation);
+		const XMVECTOR localScale = XMLoadFloat3(&local.scale);
+		gassert(!XMVector3IsNaN(localPosition));
+		gassert(!XMVector4IsNaN(localRotation));
+		gassert(!XMVector3IsNaN(localScale));
+
+		const XMMATRIX localTransform = XMMatrixAffineTransformation(
+			localScale,
+			g_XMZero.v,
+			localRotation,
+			localPosition);
+		gassert(!XMMatrixIsNaN(localTransform));
+
+		const XMMATRIX mat = XMMatrixMultiply(localTransform, parentWorld);
+		gassert(!XMMatrixIsNaN(mat));
+		return mat;
+	}
+}
\ No newline at end of file
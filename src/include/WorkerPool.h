@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "short_numbers.h"
+
+namespace ggp
+{
+	/// <summary>
+	/// A fixed set of threads which sleep until handed a ParallelFor. The calling thread works on the
+	/// loop too, and nothing else can be queued, so there is no task allocation.
+	/// </summary>
+	class WorkerPool
+	{
+	public:
+		/// <param name="workerCount">Threads to start besides the caller. Defaults to one less than the core count.</param>
+		explicit WorkerPool(u32 workerCount = DefaultWorkerCount()) noexcept;
+		~WorkerPool() noexcept;
+
+		WorkerPool(const WorkerPool&) = delete;
+		WorkerPool& operator=(const WorkerPool&) = delete;
+		WorkerPool(WorkerPool&&) = delete;
+		WorkerPool& operator=(WorkerPool&&) = delete;
+
+		static u32 DefaultWorkerCount() noexcept;
+
+		// including the calling thread
+		inline u32 GetThreadCount() const noexcept { return u32(m_workers.size()) + 1; }
+
+		/// <summary>
+		/// Call function(i) once for every i in [0, count), spread over all the threads, and return once
+		/// every call has returned. Which thread gets which index is not defined, so the calls should not
+		/// depend on each other. Not reentrant.
+		/// </summary>
+		template <typename Function>
+		inline void ParallelFor(u32 count, const Function& function) noexcept
+		{
+			Run(Job{
+				.function = [](const void* context, u32 index) { (*static_cast<const Function*>(context))(index); },
+				.context = &function,
+				.count = count,
+			});
+		}
+
+	private:
+		struct Job
+		{
+			void (*function)(const void* context, u32 index);
+			const void* context;
+			u32 count;
+		};
+
+		void Run(const Job&) noexcept;
+		// take indices from the current job until there are none left
+		void Work(const Job&) noexcept;
+		void WorkerMain() noexcept;
+
+		std::vector<std::thread> m_workers;
+		std::mutex m_lock;
+		std::condition_variable m_jobStarted;
+		std::condition_variable m_jobFinished;
+		Job m_job = {};
+		// bumped for every job, so a worker can tell a new one from the one it just finished
+		u64 m_jobGeneration = 0;
+		// workers which have not finished the current job yet
+		u32 m_busyWorkers = 0;
+		bool m_stop = false;
+		std::atomic<u32> m_nextIndex = 0;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <bit>
+#include "short_numbers.h"
+#include "errors.h"
+
+namespace ggp
+{
+	/// <summary>
+	/// A bitset with a second level of summary bits, one per 64 bit word, which is set if that word has
+	/// any bits set. Finding the lowest set bit skips over 4096 empty bits per summary word.
+	/// </summary>
+	class HierarchicalBitset
+	{
+	public:
+		static constexpr size_t npos = ~size_t(0);
+
+		inline void Resize(size_t bitCount) noexcept
+		{
+			m_bitCount = bitCount;
+			m_words.resize(WordCount(bitCount), 0);
+			m_summary.resize(WordCount(m_words.size()), 0);
+		}
+
+		inline size_t Size() const noexcept { return m_bitCount; }
+
+		inline bool Test(size_t i) const noexcept
+		{
+			gassert(i < m_bitCount);
+			return (m_words[i / 64] >> (i % 64)) & 1;
+		}
+
+		inline void Set(size_t i) noexcept
+		{
+			gassert(i < m_bitCount);
+			m_words[i / 64] |= u64(1) << (i % 64);
+			m_summary[i / 4096] |= u64(1) << ((i / 64) % 64);
+			if (i / 4096 < m_firstSummaryHint)
+				m_firstSummaryHint = i / 4096;
+		}
+
+		inline void Clear(size_t i) noexcept
+		{
+			gassert(i < m_bitCount);
+			u64& word = m_words[i / 64];
+			word &= ~(u64(1) << (i % 64));
+			if (word == 0)
+				m_summary[i / 4096] &= ~(u64(1) << ((i / 64) % 64));
+		}
+
+		/// <summary>
+		/// Set every bit in [begin, end).
+		/// </summary>
+		inline void SetRange(size_t begin, size_t end) noexcept
+		{
+			gassert(begin <= end && end <= m_bitCount);
+			if (begin == end)
+				return;
+			AssignRange(m_words, begin, end, true);
+			AssignRange(m_summary, begin / 64, ((end - 1) / 64) + 1, true);
+			if (begin / 4096 < m_firstSummaryHint)
+				m_firstSummaryHint = begin / 4096;
+		}
+
+		/// <summary>
+		/// Clear every bit in [begin, end).
+		/// </summary>
+		inline void ClearRange(size_t begin, size_t end) noexcept
+		{
+			gassert(begin <= end && end <= m_bitCount);
+			if (begin == end)
+				return;
+			AssignRange(m_words, begin, end, false);
+			// every word in between is empty now, but the ones at either end can have bits outside of the range
+			const size_t firstWord = begin / 64;
+			const size_t lastWord = (end - 1) / 64;
+			AssignRange(m_summary, firstWord, lastWord + 1, false);
+			if (m_words[firstWord] != 0)
+				m_summary[firstWord / 64] |= u64(1) << (firstWord % 64);
+			if (m_words[lastWord] != 0)
+				m_summary[lastWord / 64] |= u64(1) << (lastWord % 64);
+		}
+
+		/// <summary>
+		/// Count the set bits in [begin, end).
+		/// </summary>
+		inline size_t CountRange(size_t begin, size_t end) const noexcept
+		{
+			gassert(begin <= end && end <= m_bitCount);
+			size_t count = 0;
+			while (begin < end && begin % 64 != 0)
+				count += Test(begin++);
+			for (; begin + 64 <= end; begin += 64)
+				count += std::popcount(m_words[begin / 64]);
+			while (begin < end)
+				count += Test(begin++);
+			return count;
+		}
+
+		/// <summary>
+		/// Get the index of the lowest set bit, or npos if there are none.
+		/// </summary>
+		inline size_t FindFirstSet() const noexcept
+		{
+			for (size_t s = m_firstSummaryHint; s < m_summary.size(); ++s)
+			{
+				if (m_summary[s] == 0)
+					continue;
+				// everything below here is known to be empty now
+				m_firstSummaryHint = s;
+				const size_t wordIndex = (s * 64) + std::countr_zero(m_summary[s]);
+				gassert(m_words[wordIndex] != 0, "summary bit set for empty word");
+				return (wordIndex * 64) + std::countr_zero(m_words[wordIndex]);
+			}
+			m_firstSummaryHint = m_summary.size();
+			return npos;
+		}
+
+	private:
+		static inline constexpr size_t WordCount(size_t bits) noexcept { return (bits + 63) / 64; }
+
+		// set or clear the non-empty range [begin, end) of bits in words: masks for the partial words at
+		// either end, and whole words in between
+		static inline void AssignRange(std::vector<u64>& words, size_t begin, size_t end, bool value) noexcept
+		{
+			const size_t first = begin / 64;
+			const size_t last = (end - 1) / 64;
+			const u64 firstMask = ~u64(0) << (begin % 64);
+			const u64 lastMask = ~u64(0) >> (63 - ((end - 1) % 64));
+			const auto assign = [value](u64& word, u64 mask) {
+				if (value)
+					word |= mask;
+				else
+					word &= ~mask;
+			};
+			if (first == last)
+			{
+				assign(words[first], firstMask & lastMask);
+				return;
+			}
+			assign(words[first], firstMask);
+			std::fill(words.begin() + first + 1, words.begin() + last, value ? ~u64(0) : u64(0));
+			assign(words[last], lastMask);
+		}
+
+		std::vector<u64> m_words;
+		std::vector<u64> m_summary;
+		size_t m_bitCount = 0;
+		// lowest summary word which might be nonzero
+		mutable size_t m_firstSummaryHint = 0;
+	};
+}
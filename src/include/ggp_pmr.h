@@ -0,0 +1,107 @@
+#pragma once
+
+#include <memory_resource>
+#include "BlockAllocator.h"
+#include "LinearArena.h"
+#include "errors.h"
+
+namespace ggp
+{
+	/// <summary>
+	/// Lets std::pmr containers allocate from a LinearArena. Deallocation does nothing, the memory is
+	/// given back when the arena is reset, so the containers must not outlive that.
+	/// </summary>
+	class ArenaMemoryResource final : public std::pmr::memory_resource
+	{
+	public:
+		explicit inline ArenaMemoryResource(LinearArena& arena) noexcept : m_arena(&arena) {}
+
+	private:
+		inline void* do_allocate(size_t bytes, size_t alignment) override
+		{
+			void* const out = m_arena->Alloc(bytes, alignment);
+			abort_if(!out, "linear arena used as memory resource is out of memory");
+			return out;
+		}
+
+		inline void do_deallocate(void*, size_t, size_t) override {}
+
+		inline bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+		{
+			return this == &other;
+		}
+
+		LinearArena* m_arena;
+	};
+
+	/// <summary>
+	/// Lets std::pmr containers allocate from a BlockAllocator. Allocations that fit in a block (node
+	/// based containers like std::pmr::list or unordered_map, mostly) go to the allocator, anything
+	/// bigger is passed on to the upstream resource.
+	/// </summary>
+	class BlockMemoryResource final : public std::pmr::memory_resource
+	{
+	public:
+		explicit inline BlockMemoryResource(
+			BlockAllocator& allocator,
+			std::pmr::memory_resource* upstream = std::pmr::new_delete_resource()) noexcept
+			: m_allocator(&allocator), m_upstream(upstream)
+		{
+		}
+
+	private:
+		inline bool Fits(size_t bytes, size_t alignment) const noexcept
+		{
+			return bytes <= m_allocator->GetBlockSize() && alignment <= m_allocator->GetBlockAlignment();
+		}
+
+		inline void* do_allocate(size_t bytes, size_t alignment) override
+		{
+			if (!Fits(bytes, alignment))
+				return m_upstream->allocate(bytes, alignment);
+			void* const out = m_allocator->Alloc().data();
+			abort_if(!out, "block allocator used as memory resource is out of memory");
+			return out;
+		}
+
+		inline void do_deallocate(void* ptr, size_t bytes, size_t alignment) override
+		{
+			if (!Fits(bytes, alignment))
+				return m_upstream->deallocate(ptr, bytes, alignment);
+			m_allocator->Free({ (u8*)ptr, m_allocator->GetBlockSize() });
+		}
+
+		inline bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+		{
+			return this == &other;
+		}
+
+		BlockAllocator* m_allocator;
+		std::pmr::memory_resource* m_upstream;
+	};
+
+	/// <summary>
+	/// Make a resource the default for every std::pmr container constructed without one, until the end
+	/// of the scope. This is global, not per thread, so only use it where nothing else is using pmr at
+	/// the same time.
+	/// </summary>
+	class ScopedDefaultResource
+	{
+	public:
+		explicit inline ScopedDefaultResource(std::pmr::memory_resource* resource) noexcept
+			: m_previous(std::pmr::set_default_resource(resource))
+		{
+		}
+
+		inline ~ScopedDefaultResource() noexcept
+		{
+			std::pmr::set_default_resource(m_previous);
+		}
+
+		ScopedDefaultResource(const ScopedDefaultResource&) = delete;
+		ScopedDefaultResource& operator=(const ScopedDefaultResource&) = delete;
+
+	private:
+		std::pmr::memory_resource* m_previous;
+	};
+}
\ No newline at end of file
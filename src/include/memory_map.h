@@ -14,6 +14,8 @@ author: Ian McFarlane
 // flAllocationType, DWORD flProtect);
 #elif defined(__linux__) || defined(__APPLE__)
 #include <errno.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #else
@@ -33,24 +35,71 @@ namespace mm {
 		int64_t code;
 	};
 
-	/// Get the system's memory page size in bytes.
-	/// Can fail on linux, in which case the returned
-	/// value is zero
-	inline uint64_t get_page_size()
-	{
+	namespace detail {
+		inline uint64_t query_page_size()
+		{
 #if defined(_WIN32)
-		SYSTEM_INFO sys_info;
-		GetSystemInfo(&sys_info);
-		return sys_info.dwPageSize;
+			SYSTEM_INFO sys_info;
+			GetSystemInfo(&sys_info);
+			return sys_info.dwPageSize;
 #elif defined(__linux__)
-		long result = sysconf(_SC_PAGESIZE);
-		if (result < 0) {
-			return 0;
+			long result = sysconf(_SC_PAGESIZE);
+			if (result < 0) {
+				return 0;
+			}
+			return (uint64_t)result;
+#else
+			return getpagesize();
+#endif
 		}
-		return (uint64_t)result;
+
+		inline uint64_t query_large_page_size()
+		{
+#if defined(__linux__)
+			// transparent huge pages have to be turned on (either "always" or "madvise") for
+			// madvise(MADV_HUGEPAGE) to do anything
+			char enabled[64] = {};
+			if (FILE* f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r")) {
+				const size_t read = fread(enabled, 1, sizeof(enabled) - 1, f);
+				fclose(f);
+				enabled[read] = 0;
+			}
+			if (enabled[0] == 0 || strstr(enabled, "[never]")) {
+				return 0;
+			}
+			unsigned long long size = 0;
+			if (FILE* f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r")) {
+				if (fscanf(f, "%llu", &size) != 1) {
+					size = 0;
+				}
+				fclose(f);
+			}
+			return (uint64_t)size;
 #else
-		return getpagesize();
+			// windows only hands out large pages to allocations which are reserved and committed
+			// all at once (MEM_LARGE_PAGES) by a process holding SeLockMemoryPrivilege, which does
+			// not work with reserving up front and committing as needed
+			return 0;
 #endif
+		}
+	}
+
+	/// Get the system's memory page size in bytes.
+	/// Can fail on linux, in which case the returned
+	/// value is zero. The OS is only asked once.
+	inline uint64_t get_page_size()
+	{
+		static const uint64_t page_size = detail::query_page_size();
+		return page_size;
+	}
+
+	/// Get the size of the large pages that mm::reserve_large_pages() can provide, or zero if
+	/// they are not available on this system (always zero outside of linux). Typically 2MB.
+	/// The OS is only asked once.
+	inline uint64_t get_large_page_size()
+	{
+		static const uint64_t large_page_size = detail::query_large_page_size();
+		return large_page_size;
 	}
 
 	/// Reserve a number of pages in virtual memory space. You cannot write to
@@ -68,7 +117,7 @@ namespace mm {
 		const uint64_t result = get_page_size();
 		if (result == 0) {
 			// code 254 means unable to get page size... unlikely
-			return map_result_t{ .code = 254 };
+			return map_result_t{ .data = nullptr, .bytes = 0, .code = 254 };
 		}
 		size_t size = num_pages * result;
 #if defined(_WIN32)
@@ -97,6 +146,56 @@ namespace mm {
 #endif
 	}
 
+	/// Same as mm::reserve_pages(), except that the reservation is aligned to the large page size and
+	/// num_pages is in large pages. Once committed, the OS is asked to back the memory with
+	/// transparent huge pages (madvise(MADV_HUGEPAGE)), but it may still fall back to normal pages
+	/// if it can't find the contiguous physical memory. Commit and decommit in multiples of
+	/// mm::get_large_page_size() to keep the large pages intact.
+	/// Returns code 253 if large pages are not available, in which case the caller should fall back
+	/// to mm::reserve_pages().
+	inline map_result_t reserve_large_pages(void* address_hint, size_t num_pages)
+	{
+		const uint64_t large_page_size = get_large_page_size();
+		if (large_page_size == 0) {
+			return map_result_t{ .data = nullptr, .bytes = 0, .code = 253 };
+		}
+		const size_t size = num_pages * large_page_size;
+#if defined(__linux__)
+		// MAP_HUGETLB would need a pool of huge pages set aside by the admin, and it commits
+		// everything up front. instead overallocate so an aligned range can be cut out of the middle
+		const size_t padded_size = size + large_page_size;
+		void* const mapped = mmap(address_hint, padded_size, PROT_NONE, MAP_ANON | MAP_PRIVATE, -1, 0);
+		if (mapped == MAP_FAILED) {
+			return map_result_t{ .data = nullptr, .bytes = 0, .code = errno };
+		}
+		const uintptr_t start = (uintptr_t)mapped;
+		const uintptr_t aligned = (start + large_page_size - 1) & ~(uintptr_t)(large_page_size - 1);
+		const size_t head = aligned - start;
+		const size_t tail = padded_size - head - size;
+		if (head != 0) {
+			munmap(mapped, head);
+		}
+		if (tail != 0) {
+			munmap((void*)(aligned + size), tail);
+		}
+		// the advice sticks to the mapping, so pages committed later with mprotect inherit it
+		if (madvise((void*)aligned, size, MADV_HUGEPAGE) != 0) {
+			const int64_t code = errno;
+			munmap((void*)aligned, size);
+			return map_result_t{ .data = nullptr, .bytes = 0, .code = code };
+		}
+		return map_result_t{
+			.data = (void*)aligned,
+			.bytes = size,
+			.code = 0,
+		};
+#else
+		(void)address_hint;
+		(void)size;
+		return map_result_t{ .data = nullptr, .bytes = 0, .code = 253 };
+#endif
+	}
+
 	/// Takes a pointer to a set of memory pages which you want to make
 	/// readable and writable by your process, specifically ones allocated by
 	/// mm_reserve_pages().
@@ -131,6 +230,78 @@ namespace mm {
 #endif
 	}
 
+	/// Fault in a range of committed pages ahead of time, so the first write to them does not
+	/// stall on the OS. The contents are left as they are.
+	/// Returns 0 on success, otherwise an errcode.
+	inline int64_t prefault_pages(void* address, size_t num_pages)
+	{
+		if (!address) {
+			return -1;
+		}
+		const uint64_t page_size = get_page_size();
+		if (page_size == 0) {
+			return -1;
+		}
+
+		size_t size = num_pages * page_size;
+#if defined(__linux__) && defined(MADV_POPULATE_WRITE)
+		// linux 5.14+, populates the pages without having to take a fault for each one
+		if (madvise(address, size, MADV_POPULATE_WRITE) == 0) {
+			return 0;
+		}
+		// older kernels say EINVAL, fall through to touching the pages
+		if (errno != EINVAL) {
+			return errno;
+		}
+#endif
+		// MADV_WILLNEED / PrefetchVirtualMemory only read in pages that are backed by something,
+		// fresh anonymous memory has to be written to. read and write back each page so the
+		// contents do not change
+		for (size_t offset = 0; offset < size; offset += page_size) {
+			volatile uint8_t* const byte = (volatile uint8_t*)address + offset;
+			*byte = *byte;
+		}
+		return 0;
+	}
+
+	/// Return committed pages to the OS, putting them back into the state they were in right after
+	/// mm::reserve_pages(). The address range stays reserved and can be committed again with
+	/// mm::commit_pages(), after which its contents are zero.
+	/// Returns 0 on success, otherwise an errcode.
+	inline int64_t decommit_pages(void* address, size_t num_pages)
+	{
+		if (!address) {
+			return -1;
+		}
+		const uint64_t result = get_page_size();
+		if (result == 0) {
+			return -1;
+		}
+
+		size_t size = num_pages * result;
+#if defined(_WIN32)
+		int64_t err = 0;
+		if (!VirtualFree(address, size, MEM_DECOMMIT)) {
+			err = GetLastError();
+			assert(err != 0);
+		}
+		return err;
+#else
+		// drop the physical pages first, then make them inaccessible again like a fresh reservation
+		if (madvise(address, size, MADV_DONTNEED) != 0) {
+			int32_t res = errno;
+			assert(res != 0);
+			return res;
+		}
+		if (mprotect(address, size, PROT_NONE) != 0) {
+			int32_t res = errno;
+			assert(res != 0);
+			return res;
+		}
+		return 0;
+#endif
+	}
+
 	/// Unmap pages starting at address and continuing for "size" bytes.
 	inline int64_t memory_unmap(void* address, size_t size)
 	{
@@ -72,15 +72,15 @@ namespace ggp
 	template <typename T, size_t align>
 	struct alignsize
 	{
-		static constexpr size_t value = round_up_to_multiple_of<align>(sizeof T);
+		static constexpr size_t value = round_up_to_multiple_of<align>(sizeof(T));
 	};
 
-	inline size_t operator""_GB(size_t const x)
+	inline size_t operator""_GB(unsigned long long const x)
 	{
 		return 1024L * 1024L * 1024L * x;
 	}
 
-	inline size_t operator""_MB(size_t const x)
+	inline size_t operator""_MB(unsigned long long const x)
 	{
 		return 1024L * 1024L * x;
 	}